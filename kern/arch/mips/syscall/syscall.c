@@ -153,6 +153,26 @@ void syscall(struct trapframe *tf) {
 	case SYS_sbrk:
 		err = sys_sbrk((userptr_t)tf->tf_a0, &retval);
 		break;
+	case SYS_mmap:
+		err = sys_mmap((userptr_t) tf->tf_a0, (size_t) tf->tf_a1,
+				(int) tf->tf_a2, (int) tf->tf_a3,
+				(userptr_t)(tf->tf_sp+16), &retval);
+		break;
+	case SYS_munmap:
+		err = sys_munmap((userptr_t) tf->tf_a0, (size_t) tf->tf_a1, &retval);
+		break;
+	case SYS_msync:
+		err = sys_msync((userptr_t) tf->tf_a0, (size_t) tf->tf_a1,
+				(int) tf->tf_a2, &retval);
+		break;
+	case SYS_madvise:
+		err = sys_madvise((userptr_t) tf->tf_a0, (size_t) tf->tf_a1,
+				(int) tf->tf_a2, &retval);
+		break;
+	case SYS_mincore:
+		err = sys_mincore((userptr_t) tf->tf_a0, (size_t) tf->tf_a1,
+				(userptr_t) tf->tf_a2, &retval);
+		break;
 	case SYS_fork:
 		err = sys_fork(tf, &retval);
 		break;
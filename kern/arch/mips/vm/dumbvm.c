@@ -136,6 +136,13 @@ coremap_used_bytes() {
 	return 0;
 }
 
+bool
+coremap_prezero(void)
+{
+	/* dumbvm zeroes nothing ahead of time */
+	return false;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -451,3 +458,51 @@ int sys_sbrk(userptr_t npages, int32_t* retval) {
 	(void) retval;
 	return 0;
 }
+
+// dumbvm has no mappings
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+		userptr_t stackargs, int32_t* retval) {
+
+	(void) addr;
+	(void) len;
+	(void) prot;
+	(void) flags;
+	(void) stackargs;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_munmap(userptr_t addr, size_t len, int32_t* retval) {
+
+	(void) addr;
+	(void) len;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_msync(userptr_t addr, size_t len, int flags, int32_t* retval) {
+
+	(void) addr;
+	(void) len;
+	(void) flags;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_madvise(userptr_t addr, size_t len, int advice, int32_t* retval) {
+
+	(void) addr;
+	(void) len;
+	(void) advice;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec, int32_t* retval) {
+
+	(void) addr;
+	(void) len;
+	(void) vec;
+	*retval = -1;
+	return ENOSYS;
+}
@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <pagetable.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -60,20 +61,31 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
         int as_id;
-		struct array* as_pagetable;
+		unsigned as_asid;    // hardware TLB address space ID
+		unsigned as_asidgen; // generation as_asid belongs to, see as_activate
+		uint32_t as_cpumask; // cpus that may hold TLB entries tagged as_asid
+		struct pagetable* as_pagetable;
 		struct array* as_regions;
-		vaddr_t as_addrPtr;
+		vaddr_t as_addrPtr;   // heap break, mappings are placed above it
 		vaddr_t as_heapBase;
+		struct region* as_heap; // the heap, NULL until the first sbrk() growth
 		vaddr_t as_stackBase;
+		bool as_suspended;   // swapped out by load control, faults wait for the resume
+		struct addrspace* as_reapnext; // queued for the reaper after as_destroy
 #endif
 };
 
 struct region {
 	vaddr_t rg_vaddr;
 	size_t rg_size;
-	int readable:1;
-	int writeable:1;
-	int executable:1;
+	unsigned readable:1;
+	unsigned writeable:1;
+	unsigned executable:1;
+	unsigned mmapped:1;      // created by mmap(), only these can be unmapped
+	unsigned shared:1;       // writes to a file backed region go back to the file
+	struct vnode* rg_vnode;  // file the region is loaded from, NULL for anonymous memory
+	off_t rg_offset;         // file offset of rg_vaddr
+	size_t rg_filesize;      // bytes backed by the file, the rest is zero filled
 };
 
 /*
@@ -99,10 +111,70 @@ struct region {
  *
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
+ *                Writes back shared mappings, then hands the address
+ *                space to the VM reaper thread, so exit doesn't wait for
+ *                its memory to be freed.
+ *
+ *    as_reclaim - free the pages, page table and regions of a destroyed
+ *                address space, and the address space itself. Called by
+ *                the reaper.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file_region - like as_define_region, but the first
+ *                FILESIZE bytes of the region are read from the file V
+ *                at OFFSET when their pages are first touched. Holds a
+ *                reference to V until the address space is destroyed.
+ *
+ *    as_define_mapping - set up a region for mmap(). Like
+ *                as_define_file_region (V may be NULL for anonymous
+ *                memory), but the region is marked as a mapping, is
+ *                never merged with the heap, and does not move the heap
+ *                break. If SHARED, dirty pages are written back to V,
+ *                which must not be NULL then.
+ *
+ *    as_find_free_range - return a page aligned address where SIZE
+ *                bytes can be mapped, HINT if that range is free, or 0.
+ *                Mappings are placed downwards from the stack so the
+ *                heap keeps room to grow.
+ *
+ *    as_set_break - move the end of the heap to BRK, a page boundary at
+ *                or above the heap base. The heap is a single region that
+ *                grows and shrinks in place, created on first use. Does
+ *                not free the pages of a shrunk heap.
+ *
+ *    as_range_free - return true if no region overlaps the pages from
+ *                VADDR to VADDR+SIZE.
+ *
+ *    as_range_mapped - return true if every page from START to END is
+ *                in some region.
+ *
+ *    as_remove_mapping - unmap the page aligned range START to END.
+ *                Dirty shared pages are written back and the pages are
+ *                freed. Fails with EINVAL, changing nothing, if any part
+ *                of the range belongs to a region not made by mmap().
+ *
+ *    as_fill_page - fill the frame at PADDR with the file contents of
+ *                the page at VADDR, for every file backed region
+ *                overlapping it. The frame must already be zeroed.
+ *
+ *    as_text_page - return true if the page at VADDR holds nothing but
+ *                read only executable contents, at a page aligned file
+ *                offset, so its frame can be shared with every process
+ *                running the same binary. Hands back the file and the
+ *                page number in it.
+ *
+ *    as_shared_page - return true if the page at VADDR belongs to a
+ *                MAP_SHARED mapping and starts before the end of the
+ *                file, so every process mapping that part of the file
+ *                must use the same frame. Hands back the file and the
+ *                page number in it like as_text_page.
+ *
+ *    as_find_region - return the region containing a virtual address,
+ *                or NULL. Regions are kept sorted, so this is a binary
+ *                search.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -122,12 +194,44 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_reclaim(struct addrspace *);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file_region(struct addrspace *as,
+                                        vaddr_t vaddr, size_t memsize,
+                                        size_t filesize,
+                                        struct vnode *v, off_t offset,
+                                        int readable,
+                                        int writeable,
+                                        int executable);
+int               as_define_mapping(struct addrspace *as,
+                                    vaddr_t vaddr, size_t memsize,
+                                    size_t filesize,
+                                    struct vnode *v, off_t offset,
+                                    int readable,
+                                    int writeable,
+                                    int executable,
+                                    int shared);
+vaddr_t           as_find_free_range(struct addrspace *as, vaddr_t hint,
+                                     size_t size);
+int               as_set_break(struct addrspace *as, vaddr_t brk);
+bool              as_range_free(struct addrspace *as, vaddr_t vaddr,
+                                size_t size);
+bool              as_range_mapped(struct addrspace *as, vaddr_t start,
+                                  vaddr_t end);
+int               as_remove_mapping(struct addrspace *as, vaddr_t start,
+                                    vaddr_t end);
+int               as_fill_page(struct addrspace *as, vaddr_t vaddr,
+                               paddr_t paddr);
+bool              as_text_page(struct addrspace *as, vaddr_t vaddr,
+                               struct vnode **v, unsigned *pageno);
+bool              as_shared_page(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode **v, unsigned *pageno);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
@@ -62,6 +62,8 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_asid;		/* Address space ID in use */
+	unsigned c_asidgen;		/* ASID generation the TLB holds */
 
 	/*
 	 * Accessed by other cpus.
@@ -88,6 +90,8 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;	/* Shootdown rounds requested */
+	unsigned c_shootdown_done;	/* Shootdown rounds completed */
 	struct spinlock c_ipi_lock;
 };
 
@@ -154,6 +158,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_sync queues N mappings (or TLBSHOOTDOWN_ALL) on
+ * every other CPU whose bit is set in CPUMASK, with one IPI per CPU,
+ * and waits until they have all been invalidated. It must be called
+ * with interrupts enabled and no spinlocks held, so that two CPUs
+ * shooting at each other both make progress.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -168,6 +177,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_sync(uint32_t cpumask,
+			   const struct tlbshootdown *mappings, int n);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap(), msync() and madvise().
+ */
+
+/* Page protections for mmap: PROT_NONE or any combination of the others */
+#define PROT_NONE     0x0    /* Pages may not be accessed */
+#define PROT_READ     0x1    /* Pages may be read */
+#define PROT_WRITE    0x2    /* Pages may be written */
+#define PROT_EXEC     0x4    /* Pages may be executed */
+
+/* Flags for mmap: choose one of these: */
+#define MAP_SHARED    0x0001 /* Writes go back to the file */
+#define MAP_PRIVATE   0x0002 /* Writes stay private to the process */
+/* then or in any of these: */
+#define MAP_ANON      0x1000 /* Zero filled memory, no file (fd is ignored).
+                                Private only, MAP_SHARED fails with EINVAL */
+#define MAP_ANONYMOUS MAP_ANON
+
+/* Flags for msync: choose one of these: */
+#define MS_ASYNC      0x1    /* Start the writeback */
+#define MS_SYNC       0x2    /* Write back before returning */
+/* then optionally or in: */
+#define MS_INVALIDATE 0x4    /* Accepted, has no effect */
+
+/* Advice for madvise: */
+#define MADV_NORMAL     0    /* No advice, the default read-ahead */
+#define MADV_RANDOM     1    /* No read-ahead */
+#define MADV_SEQUENTIAL 2    /* Read ahead further */
+#define MADV_WILLNEED   3    /* Start reading the pages back in */
+#define MADV_DONTNEED   4    /* Free the pages, they read back as new */
+
+/* Returned by the libc mmap on error */
+#define MAP_FAILED    ((void *)-1)
+
+
+#endif /* _KERN_MMAN_H_ */
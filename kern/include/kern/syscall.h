@@ -59,12 +59,13 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
-//#define SYS_mincore    12
+#define SYS_madvise      11
+#define SYS_mincore      12
 //#define SYS_mlock      13
 //#define SYS_munlock    14
 //#define SYS_munlockall 15
 //#define SYS_minherit   16
+#define SYS_msync        121
 //                              (security/credentials)
 #define SYS_umask        17
 #define SYS_issetugid    18
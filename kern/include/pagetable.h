@@ -0,0 +1,56 @@
+/**
+ * pagetable.h
+ *
+ * Two level page table for user address spaces, indexed by virtual page
+ * number. The directory holds pointers to leaf tables and every leaf table
+ * is exactly one page of struct page entries, so lookup, insert and remove
+ * are constant time and no per page allocation is needed.
+ *
+ */
+
+#ifndef PAGE_TABLE_H
+#define PAGE_TABLE_H
+#include <types.h>
+#include <vm.h>
+
+/*
+ * User space ends at USERSPACETOP (0x80000000), so a user virtual page
+ * number has 19 significant bits: the top 10 select the directory slot and
+ * the low 9 select the entry within the leaf. 512 eight byte entries fill
+ * exactly one page.
+ */
+#define PT_L2_BITS 9
+#define PT_L1_BITS 10
+#define PT_L2_SIZE (1 << PT_L2_BITS)
+#define PT_L1_SIZE (1 << PT_L1_BITS)
+
+#define PT_L1_INDEX(vaddr) (((vaddr) / PAGE_SIZE) >> PT_L2_BITS)
+#define PT_L2_INDEX(vaddr) (((vaddr) / PAGE_SIZE) & (PT_L2_SIZE - 1))
+#define PT_VADDR(l1, l2) ((vaddr_t)(((l1) << PT_L2_BITS) | (l2)) * PAGE_SIZE)
+
+struct pagetable {
+	struct page* pt_leaves[PT_L1_SIZE]; // NULL until a page in that range is touched
+};
+
+struct pagetable* pagetable_create(void);
+
+/* Free the directory and the leaves. Frames and swap pages must be released by the caller. */
+void pagetable_destroy(struct pagetable* pt);
+
+/* Return the valid entry for vaddr, or NULL if the page was never touched */
+struct page* pagetable_lookup(struct pagetable* pt, vaddr_t vaddr);
+
+/* Return the entry for vaddr marked valid, allocating the leaf if needed. NULL when out of memory */
+struct page* pagetable_insert(struct pagetable* pt, vaddr_t vaddr);
+
+/* Mark the entry for vaddr invalid */
+void pagetable_remove(struct pagetable* pt, vaddr_t vaddr);
+
+/*
+ * Iterate over the valid entries in [*cursor, end). Returns the next entry
+ * and advances *cursor past it, or NULL when the range is exhausted. Empty
+ * leaves are skipped without looking at their entries.
+ */
+struct page* pagetable_next(struct pagetable* pt, vaddr_t* cursor, vaddr_t end);
+
+#endif
@@ -73,6 +73,12 @@ int sys_dup2(userptr_t oldfd, userptr_t newfd , int32_t* retval);
 
 // memory system calls
 int sys_sbrk(userptr_t npages, int32_t* retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+		userptr_t stackargs, int32_t* retval);
+int sys_munmap(userptr_t addr, size_t len, int32_t* retval);
+int sys_msync(userptr_t addr, size_t len, int flags, int32_t* retval);
+int sys_madvise(userptr_t addr, size_t len, int advice, int32_t* retval);
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec, int32_t* retval);
 // process system calls
 
 int sys_fork(struct trapframe* tf, pid_t* pid);
@@ -41,28 +41,69 @@ struct core_map_entry{
 	// address space identifier
 	struct addrspace* as;
 
-	// used the free the entire chunk, when more than one page is allocated
-	unsigned chunk_start;
-
-	// lowest bit for free/used, second lowest for clean/dirty
+	// reverse map to the page table entry mapping this frame, NULL for
+	// kernel frames, frames being set up and shared frames with no known owner
+	struct page* pte;
+
+	// number of pages in an allocated chunk, kept on the first page of the chunk
+	unsigned chunk_npages;
+
+	// buddy allocator free list links, kept on the first page of a free block,
+	// and text page cache bucket links while the frame is in the cache
+	int next_free;
+	int prev_free;
+
+	// order of a free block, kept on the first page of the block
+	unsigned char order;
+
+	// lowest bit for free/used, second lowest for clean/dirty,
+	// third lowest marks the first page of a free buddy block,
+	// fourth lowest marks a free frame that is already zeroed,
+	// fifth lowest marks a frame in the page cache.
+	// A user frame is dirty once written through a TLB entry, until then
+	// it matches swap_slot, or what as_fill_page would put in it
 	char page_state;
 
+	// swap slot still holding a copy of a clean frame, -1 if none
+	int swap_slot;
+
+	// page cache key: the executable and the page number in it, or NULL
+	// and the contents checksum for a frame shared by page merging
+	struct vnode* pc_vnode;
+	unsigned pc_pageno;
+
+	// contents checksum seen by the last page merging pass
+	uint32_t merge_sum;
+
+	// number of page table entries mapping this frame, more than one when shared copy-on-write
+	unsigned refcount;
+
 	// may need to add more members for our page replacement algorithm
 };
 
 
+/*
+ * Page table entry, kept to 8 bytes so that a page table leaf is one page.
+ * See pagetable.h.
+ */
 struct page {
 	vaddr_t pt_virtbase:20;
 	paddr_t pt_pagebase:20;
 	size_t pt_permission:3;
-	int pt_state:8;
-	int pt_valid:1;
-	int pt_reference:1;
+	unsigned pt_state:2; // PT_STATE_*
+	unsigned pt_valid:1;
+	unsigned pt_reference:1;
+	unsigned pt_cow:1; // frame is shared with another address space, copy before writing
+	unsigned pt_dirty:1; // written since last written back to the file, shared mappings only
+	unsigned pt_advice:2; // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL, sets the read-ahead
 	//where is it ? stack or heap?
 };
 
 #define PT_STATE_MAPPED 0
 #define PT_STATE_SWAPPED 1
+#define PT_STATE_INTRANSIT 2 // swap I/O under way, wait for it: being written to swap, the
+                             // frame is still in pt_pagebase, or being read from the slot
+#define PT_STATE_DROPPED 3 // was clean and never swapped, refilled like a new page
 
 #include <machine/vm.h>
 #include <array.h>
@@ -89,7 +130,47 @@ void free_kpages(vaddr_t addr);
 vaddr_t coremap_allocuserpages(unsigned npages, struct addrspace* as);
 void coremap_freeuserpages(paddr_t addr);
 
-void freePage(struct page* page);
+/*
+ * Zero one free frame ahead of time for the pre-zeroed pool. Called from
+ * the idle loop, never sleeps. Returns false if there was nothing to do.
+ */
+bool coremap_prezero(void);
+
+/* Record the page table entry that maps a user frame */
+void coremap_setpte(paddr_t addr, struct page* pg);
+
+/*
+ * Free the frames and swap pages of a destroyed address space. Its TLB
+ * entries are left alone: its ASID is never handed out again in this
+ * generation, so nothing can match them.
+ */
+void vm_freeall(struct addrspace* as);
+
+/* Have the reaper thread call as_reclaim, or call it now if there is none */
+void vm_reap(struct addrspace* as);
+
+/* Free the pages between start and end, and drop their TLB entries everywhere */
+void vm_unmap(struct addrspace* as, vaddr_t start, vaddr_t end);
+
+/*
+ * Write the dirty pages of shared file mappings between start and end
+ * back to their files. Returns the first error, but tries every page.
+ */
+int vm_msync(struct addrspace* as, vaddr_t start, vaddr_t end);
+
+/* Let a process swapped out by load control run again, if it is one */
+void vm_resume(struct addrspace* as);
+
+/* Stop prefetching pages of [start, end) of the address space, see sys_madvise */
+void vm_prefetch_cancel(struct addrspace* as, vaddr_t start, vaddr_t end);
+
+/*
+ * Copy a page table entry of oldas into another address space, sharing
+ * the frame copy-on-write, or writable if the page is in a MAP_SHARED
+ * mapping. Returns ENOMEM if there was no memory for the copy.
+ */
+int page_copy(struct addrspace* oldas, struct addrspace* newas,
+		struct page* pg, bool shared);
 
 /*
  * Return amount of memory (in bytes) used by allocated coremap pages.  If
@@ -98,6 +179,36 @@ void freePage(struct page* page);
  */
 unsigned int coremap_used_bytes(void);
 
+/*
+ * Counters for the paging system, printed by vm_printstats (menu command
+ * "vmstat"). They only ever increase.
+ */
+struct vm_stats {
+	unsigned vs_faults;      // calls to vm_fault for a valid address
+	unsigned vs_zerofills;   // first touch of a page
+	unsigned vs_majorfaults; // page had to be read back from swap
+	unsigned vs_evictions;   // page written to swap to free its frame
+	unsigned vs_cowcopies;   // frame copied on a write to a shared page
+	unsigned vs_swapwrites;  // write requests to the swap disk
+	unsigned vs_swapreads;   // read requests to the swap disk
+	unsigned vs_readahead;   // pages read back before they were faulted on
+	unsigned vs_prezeroed;   // frames handed out from the pre-zeroed pool
+	unsigned vs_cleanevictions; // evicted pages that needed no write
+	unsigned vs_refills;     // dropped pages filled again on a fault
+	unsigned vs_textshared;  // text pages mapped from the page cache
+	unsigned vs_textmisses;  // text pages read into the page cache
+	unsigned vs_zstores;     // pages kept in the compressed swap pool
+	unsigned vs_zloads;      // pages read back from the compressed pool
+	unsigned vs_zwritebacks; // pages moved from the pool to the swap disk
+	unsigned vs_merged;      // pages merged into an identical frame
+	unsigned vs_faultwait;   // microseconds faults spent bringing pages in
+	unsigned vs_suspends;    // processes swapped out by load control
+	unsigned vs_prefetched;  // swapped pages read back for MADV_WILLNEED
+	unsigned vs_cleaned;     // shared file pages written back by pageout
+};
+
+void vm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
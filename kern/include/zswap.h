@@ -0,0 +1,50 @@
+/**
+ * zswap.h
+ *
+ * Compressed swap pool. Pages written to swap are compressed into a pool
+ * of reserved kernel memory and only reach the swap disk when the pool is
+ * full. The pool is keyed by swap slot, so a slot holds its page either in
+ * the pool or on the disk, never partly in both, and the rest of the VM
+ * system keeps working in terms of slots.
+ *
+ * The pool is a circular log: pages are appended at the head and the
+ * oldest ones, at the tail, are the ones written out to make room. A page
+ * whose slot is freed leaves a hole that is skipped when the tail gets to
+ * it.
+ *
+ */
+
+#ifndef ZSWAP_H
+#define ZSWAP_H
+#include <types.h>
+
+/* Use SIZE bytes at POOL for the pool, for a swap disk of NSLOTS pages */
+int zswap_init(void* pool, size_t size, unsigned nslots);
+
+/*
+ * Compress the page and keep it for the slot. Returns ENOSPC if the pool
+ * is full, then the caller writes its oldest page out and tries again,
+ * or E2BIG if the page doesn't compress well enough to be worth keeping.
+ * Callers serialize zswap_store and the writeback calls.
+ */
+int zswap_store(int slot, const void* page);
+
+/* Decompress the slot's page into PAGE. Returns false if it isn't in the pool */
+bool zswap_load(int slot, void* page);
+
+/* The slot was freed, drop its page if the pool has it */
+void zswap_invalidate(int slot);
+
+/*
+ * Decompress the oldest page into PAGE and return its slot, or -1 if the
+ * pool is empty. The page stays in the pool, and loads still find it,
+ * until the caller has written it to the disk and calls
+ * zswap_writeback_done.
+ */
+int zswap_writeback(void* page);
+void zswap_writeback_done(int slot);
+
+/* Pages held, and bytes of the pool in use including holes */
+void zswap_usage(unsigned* npages, unsigned* used, unsigned* size);
+
+#endif
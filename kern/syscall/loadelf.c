@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Without dumbvm the executable is demand paged: each segment is
+ * recorded with as_define_file_region and its pages are read from the
+ * file by vm_fault when first touched, so nothing is loaded here.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -60,6 +61,7 @@
 #include <vnode.h>
 #include <elf.h>
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +146,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -242,11 +245,32 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 				ph.p_type);
 			return ENOEXEC;
 		}
+#if OPT_DUMBVM
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
+#else
+		/*
+		 * The segment is read from the file a page at a time by
+		 * vm_fault, so there is no uiomove to catch a load
+		 * address in kernel space. Check for it here.
+		 */
+		if (ph.p_vaddr >= USERSPACETOP ||
+		    ph.p_memsz > USERSPACETOP - ph.p_vaddr) {
+			return ENOEXEC;
+		}
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+		}
+		result = as_define_file_region(as,
+					       ph.p_vaddr, ph.p_memsz,
+					       ph.p_filesz, v, ph.p_offset,
+					       ph.p_flags & PF_R,
+					       ph.p_flags & PF_W,
+					       ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -257,6 +281,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +320,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		}
 	}
 
+#endif /* OPT_DUMBVM */
+
 	result = as_complete_load(as);
 	if (result) {
 		return result;
@@ -48,6 +48,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 
@@ -183,6 +184,8 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -190,6 +193,8 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -659,7 +664,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Spend idle time zeroing free frames, then sleep. */
+			if (!coremap_prezero()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -1164,10 +1172,11 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
-	else {
+	else if (n != TLBSHOOTDOWN_ALL) {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	target->c_shootdown_seq++;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1175,6 +1184,62 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_sync(uint32_t cpumask,
+		      const struct tlbshootdown *mappings, int n)
+{
+	unsigned seq[32];
+	unsigned i, j;
+	int k;
+	struct cpu *c;
+	bool done;
+
+	KASSERT(n == TLBSHOOTDOWN_ALL || (n >= 0 && n <= TLBSHOOTDOWN_MAX));
+	KASSERT(curcpu->c_spinlocks == 0);
+	KASSERT(curthread->t_curspl == 0);
+
+	for (i=0; i < cpuarray_num(&allcpus) && i < 32; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((cpumask & ((uint32_t)1 << i)) == 0 || c == curcpu->c_self) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		k = c->c_numshootdown;
+		if (k != TLBSHOOTDOWN_ALL) {
+			if (n == TLBSHOOTDOWN_ALL || k + n > TLBSHOOTDOWN_MAX) {
+				c->c_numshootdown = TLBSHOOTDOWN_ALL;
+			}
+			else {
+				for (j=0; j < (unsigned)n; j++) {
+					c->c_shootdown[k+j] = mappings[j];
+				}
+				c->c_numshootdown = k+n;
+			}
+		}
+		seq[i] = ++c->c_shootdown_seq;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+
+	/*
+	 * Wait for every target to finish a round at least as new as
+	 * ours. Interrupts stay on, so shootdowns aimed at us get done.
+	 */
+	for (i=0; i < cpuarray_num(&allcpus) && i < 32; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((cpumask & ((uint32_t)1 << i)) == 0 || c == curcpu->c_self) {
+			continue;
+		}
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			done = (int)(c->c_shootdown_done - seq[i]) >= 0;
+			spinlock_release(&c->c_ipi_lock);
+		} while (!done);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1216,6 +1281,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -244,8 +244,11 @@ static
 int
 dev_mmap(struct vnode *v  /* add stuff as needed */)
 {
-	(void)v;
-	return ENOSYS;
+	/* Pages are moved with dev_read and dev_write, which need offsets */
+	if (!dev_isseekable(v)) {
+		return ENODEV;
+	}
+	return 0;
 }
 
 /*
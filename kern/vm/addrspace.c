@@ -35,6 +35,11 @@
 #include <proc.h>
 #include <mips/tlb.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -44,6 +49,50 @@
 
 static unsigned int s_addrspaceCounter = 0;
 
+/*
+ * Hardware address space IDs are handed out in generations. Once all
+ * NUM_ASID are used a new generation starts, and every address space from
+ * an older one gets a new ID the next time it is activated. A cpu flushes
+ * its TLB when it first activates an address space of a newer generation
+ * than the one its TLB entries belong to, so an ID is never matched by
+ * entries left over from its previous owner.
+ */
+static struct spinlock as_asid_lock = SPINLOCK_INITIALIZER;
+static unsigned as_asid_generation = 1;
+static unsigned as_asid_next = 0;
+
+/* Invalidate every entry in this cpu's TLB */
+static void as_tlbflush(void) {
+	int spl = splhigh();
+	int i;
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	// tlb_write clobbered the current address space ID
+	tlb_setasid(curcpu->c_asid);
+	splx(spl);
+}
+
+/* Give the address space an ID of the current generation, and return that generation */
+static unsigned as_assignAsid(struct addrspace *as) {
+	spinlock_acquire(&as_asid_lock);
+	if (as->as_asidgen != as_asid_generation) {
+		if (as_asid_next == NUM_ASID) {
+			as_asid_generation++;
+			as_asid_next = 0;
+		}
+		as->as_asid = as_asid_next++;
+		as->as_asidgen = as_asid_generation;
+		// entries under the old ID can no longer be matched
+		as->as_cpumask = 0;
+	}
+	KASSERT(curcpu->c_number < 32);
+	as->as_cpumask |= (uint32_t) 1 << curcpu->c_number;
+	unsigned generation = as_asid_generation;
+	spinlock_release(&as_asid_lock);
+	return generation;
+}
+
 static int as_getNewAddrSpaceId() {
 	// TODO lock this up
 	return s_addrspaceCounter++;
@@ -57,32 +106,34 @@ as_create(void) {
 	if (as == NULL) {
 		return NULL;
 	}
-	as->as_pagetable = array_create();
+	as->as_pagetable = pagetable_create();
 	if(as->as_pagetable == NULL) {
 		kfree(as);
 		return NULL;
 	}
-	if (array_preallocate(as->as_pagetable, 1024) == ENOMEM) {
-		array_destroy(as->as_pagetable);
-		kfree(as);
-		return NULL;
-	}
 	as->as_regions = array_create();
 	if(as->as_regions == NULL) {
-		array_destroy(as->as_pagetable);
+		pagetable_destroy(as->as_pagetable);
 		kfree(as);
 		return NULL;
 	}
 	if (array_preallocate(as->as_regions, 1024) == ENOMEM) {
 		array_destroy(as->as_regions);
-		array_destroy(as->as_pagetable);
+		pagetable_destroy(as->as_pagetable);
 		kfree(as);
 		return NULL;
 	}
 	//kprintf("Newly created pagetable: %p, region: %p\n", as->as_pagetable, as->as_regions);
 	as->as_id = as_getNewAddrSpaceId();
 	as->as_heapBase = 0;
+	as->as_heap = NULL;
 	as->as_stackBase = 0;
+	as->as_suspended = false;
+	as->as_reapnext = NULL;
+	// no ID until the first as_activate
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpumask = 0;
 	/*
 	 * Initialize as needed.
 	 */
@@ -106,6 +157,7 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
 		struct region* reg = array_get(old->as_regions, i);
 		struct region* newReg = (struct region*) kmalloc(sizeof(struct region));
 		if(newReg == NULL) {
+			as_reclaim(newas);
 			return ENOMEM;
 		}
 		newReg->executable = reg->executable;
@@ -113,18 +165,49 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
 		newReg->rg_size = reg->rg_size;
 		newReg->rg_vaddr = reg->rg_vaddr;
 		newReg->writeable = reg->writeable;
-		unsigned int idx;
-		array_add(newas->as_regions, newReg, &idx);
-	}
-	for (i = 0; i < array_num(old->as_pagetable); i++) {
-		struct page* pg = array_get(old->as_pagetable, i);
-		struct page* newPg = page_create(newas, pg->pt_virtbase * PAGE_SIZE);
-		if(newPg == NULL) {
+		newReg->mmapped = reg->mmapped;
+		newReg->shared = reg->shared;
+		newReg->rg_vnode = reg->rg_vnode;
+		newReg->rg_offset = reg->rg_offset;
+		newReg->rg_filesize = reg->rg_filesize;
+		if (array_add(newas->as_regions, newReg, NULL)) {
+			kfree(newReg);
+			as_reclaim(newas);
 			return ENOMEM;
 		}
-		memmove(PADDR_TO_KVADDR((void*) (newPg->pt_pagebase * PAGE_SIZE)),
-				PADDR_TO_KVADDR((void*) (pg->pt_pagebase * PAGE_SIZE)),
-				PAGE_SIZE);
+		// as_reclaim drops the reference of every region in the list
+		if (newReg->rg_vnode != NULL) {
+			VOP_INCREF(newReg->rg_vnode);
+		}
+		if (reg == old->as_heap) {
+			newas->as_heap = newReg;
+		}
+	}
+	vaddr_t cursor = 0;
+	struct page* pg;
+	while ((pg = pagetable_next(old->as_pagetable, &cursor, USERSPACETOP)) != NULL) {
+		// resident pages are shared read only until one side writes,
+		// except in shared mappings where writes are meant to be seen.
+		// Pages of those neither side has touched yet are shared through
+		// the page cache when they are, see as_shared_page
+		struct region* reg = as_find_region(old, pg->pt_virtbase * PAGE_SIZE);
+		bool shared = reg != NULL && reg->shared;
+		int result = page_copy(old, newas, pg, shared);
+		if (result) {
+			as_reclaim(newas);
+			return result;
+		}
+	}
+	/*
+	 * The parent's TLB entries, here or on other cpus, may still allow
+	 * writes to the shared frames. Moving the parent to a fresh ID makes
+	 * all of them unmatchable without a flush or a shootdown.
+	 */
+	spinlock_acquire(&as_asid_lock);
+	old->as_asidgen = 0;
+	spinlock_release(&as_asid_lock);
+	if (old == proc_getas()) {
+		as_activate();
 	}
 	*ret = newas;
 	return 0;
@@ -134,25 +217,38 @@ void as_destroy(struct addrspace *as) {
 	/*
 	 * Clean up as needed.
 	 */
-	int regionCount = array_num(as->as_regions);
-	int i;
+	// the process may exit while load control has it swapped out, or
+	// while its pages are being prefetched
+	vm_resume(as);
+	vm_prefetch_cancel(as, 0, USERSPACETOP);
+
+	// exit unmaps everything, so shared mappings are written back first
+	vm_msync(as, 0, USERSPACETOP);
+
+	// nothing runs in it any more, the reaper frees the rest
+	vm_reap(as);
+}
+
+void as_reclaim(struct addrspace *as) {
+	// before the files go, the text page cache knows frames by their vnode
+	vm_freeall(as);
+	// load control may have suspended it again since as_destroy, but
+	// can't pick it once no frame is in its name
+	vm_resume(as);
+	pagetable_destroy(as->as_pagetable);
+
+	unsigned regionCount = array_num(as->as_regions);
+	unsigned i;
 	for (i = 0; i < regionCount; i++) {
-		struct region* reg = array_get(as->as_regions, 0);
+		struct region* reg = array_get(as->as_regions, i);
+		if (reg->rg_vnode != NULL) {
+			VOP_DECREF(reg->rg_vnode);
+		}
 		kfree(reg);
-		array_remove(as->as_regions, 0);
 	}
+	array_setsize(as->as_regions, 0);
 	array_destroy(as->as_regions);
 
-	int pageCount = array_num(as->as_pagetable);
-	for (i = 0; i < pageCount; i++) {
-		struct page* pg = array_get(as->as_pagetable, 0);
-		// TODO move free page to a single method that handles swap as well as regular
-		freePage(pg);
-		kfree(pg);
-		array_remove(as->as_pagetable, 0);
-	}
-	array_destroy(as->as_pagetable);
-
 	kfree(as);
 }
 
@@ -169,13 +265,17 @@ void as_activate(void) {
 	}
 
 	/*
-	 * Write this.
+	 * Entries are tagged with the address space ID, so the TLB only has
+	 * to be flushed when IDs have been recycled.
 	 */
 	int spl = splhigh();
-	int i;
-	for (i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	unsigned generation = as_assignAsid(as);
+	curcpu->c_asid = as->as_asid;
+	if (curcpu->c_asidgen != generation) {
+		as_tlbflush();
+		curcpu->c_asidgen = generation;
 	}
+	tlb_setasid(as->as_asid);
 	splx(spl);
 }
 
@@ -187,6 +287,159 @@ void as_deactivate(void) {
 	 */
 }
 
+/*
+ * Index of the first region in the sorted region list that starts at or
+ * after vaddr (the number of regions starting below vaddr).
+ */
+static unsigned as_region_lowerbound(struct addrspace *as, vaddr_t vaddr) {
+	unsigned lo = 0, hi = array_num(as->as_regions);
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		struct region* reg = array_get(as->as_regions, mid);
+		if (reg->rg_vaddr < vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+struct region* as_find_region(struct addrspace *as, vaddr_t vaddr) {
+	// the candidate is the last region starting at or below vaddr
+	unsigned idx = as_region_lowerbound(as, vaddr + 1);
+	if (idx == 0) {
+		return NULL;
+	}
+	struct region* reg = array_get(as->as_regions, idx - 1);
+	if (vaddr < reg->rg_vaddr + reg->rg_size) {
+		return reg;
+	}
+	return NULL;
+}
+
+bool as_text_page(struct addrspace *as, vaddr_t vaddr, struct vnode **v,
+		unsigned *pageno) {
+	vaddr_t pagestart = vaddr & PAGE_FRAME;
+	struct region* reg = as_find_region(as, pagestart);
+	// only executables, data files may change while they are mapped
+	if (reg == NULL || reg->rg_vnode == NULL || reg->writeable || reg->mmapped
+			|| pagestart + PAGE_SIZE > reg->rg_vaddr + reg->rg_size) {
+		return false;
+	}
+	off_t offset = reg->rg_offset + (pagestart - reg->rg_vaddr);
+	if (offset % PAGE_SIZE != 0) {
+		return false;
+	}
+	*v = reg->rg_vnode;
+	*pageno = offset / PAGE_SIZE;
+	return true;
+}
+
+bool as_shared_page(struct addrspace *as, vaddr_t vaddr, struct vnode **v,
+		unsigned *pageno) {
+	vaddr_t pagestart = vaddr & PAGE_FRAME;
+	struct region* reg = as_find_region(as, pagestart);
+	// pages wholly past the end of the file have no file page to share
+	if (reg == NULL || !reg->shared
+			|| pagestart >= reg->rg_vaddr + reg->rg_filesize) {
+		return false;
+	}
+	off_t offset = reg->rg_offset + (pagestart - reg->rg_vaddr);
+	if (offset % PAGE_SIZE != 0) {
+		return false;
+	}
+	*v = reg->rg_vnode;
+	*pageno = offset / PAGE_SIZE;
+	return true;
+}
+
+/*
+ * Two regions can be merged when they have the same permissions and the
+ * second one starts on the page where the first one ends. File backed
+ * regions are never merged, their pages map to their own file offsets,
+ * and neither are mappings with the heap.
+ */
+static bool as_region_canmerge(struct region* first, struct region* second) {
+	return first->rg_vnode == NULL && second->rg_vnode == NULL
+			&& first->mmapped == second->mmapped
+			&& first->readable == second->readable
+			&& first->writeable == second->writeable
+			&& first->executable == second->executable
+			&& ROUNDUP(first->rg_vaddr + first->rg_size, PAGE_SIZE)
+					== (second->rg_vaddr & PAGE_FRAME);
+}
+
+/* Put reg at index in the sorted region list */
+static int as_region_insert(struct addrspace *as, unsigned index,
+		struct region* reg) {
+	// append, then slide the tail up to open a slot at index
+	unsigned int i = array_num(as->as_regions);
+	if (array_add(as->as_regions, reg, NULL)) {
+		return ENOMEM;
+	}
+	for (; i > index; i--) {
+		array_set(as->as_regions, i, array_get(as->as_regions, i - 1));
+	}
+	array_set(as->as_regions, index, reg);
+	return 0;
+}
+
+/*
+ * Regions are kept sorted by start address so that faults can find
+ * theirs with a binary search. A new region that touches a neighbour
+ * with the same permissions is merged into it, so the region count stays
+ * small. The heap is left alone, it moves its end through as_set_break.
+ */
+static int as_region_add(struct addrspace *as, struct region newregion) {
+	vaddr_t vaddr = newregion.rg_vaddr;
+	size_t memsize = newregion.rg_size;
+	unsigned int index = as_region_lowerbound(as, vaddr);
+	struct region* prev = NULL;
+	struct region* next = NULL;
+	if (index > 0) {
+		prev = array_get(as->as_regions, index - 1);
+	}
+	if (index < array_num(as->as_regions)) {
+		next = array_get(as->as_regions, index);
+	}
+
+	if (prev == as->as_heap) {
+		prev = NULL;
+	}
+	if (next == as->as_heap) {
+		next = NULL;
+	}
+
+	if (prev != NULL && as_region_canmerge(prev, &newregion)) {
+		prev->rg_size = vaddr + memsize - prev->rg_vaddr;
+		if (next != NULL && as_region_canmerge(prev, next)) {
+			prev->rg_size = next->rg_vaddr + next->rg_size - prev->rg_vaddr;
+			array_remove(as->as_regions, index);
+			kfree(next);
+		}
+	} else if (next != NULL && as_region_canmerge(&newregion, next)) {
+		next->rg_size = next->rg_vaddr + next->rg_size - vaddr;
+		next->rg_vaddr = vaddr;
+	} else {
+		struct region* reg = (struct region*) kmalloc(sizeof(struct region));
+		if (reg == NULL) {
+			return ENOMEM;
+		}
+		*reg = newregion;
+		if (as_region_insert(as, index, reg)) {
+			kfree(reg);
+			return ENOMEM;
+		}
+	}
+
+	if (!newregion.mmapped) {
+		// adjust this to be the next closest multiple of 4096
+		as->as_addrPtr = ROUNDUP(vaddr + memsize, PAGE_SIZE);
+	}
+	return 0;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -199,28 +452,259 @@ void as_deactivate(void) {
  */
 int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		int readable, int writeable, int executable) {
-	/*
-	 * Write this.
-	 */
-	struct region* newregion = (struct region*) kmalloc(sizeof(struct region));
-
-	newregion->executable = executable;
-	newregion->readable = readable;
-	newregion->writeable = writeable;
-
-	newregion->rg_size = memsize;
-	newregion->rg_vaddr = vaddr;
-	unsigned int index;
-	array_add(as->as_regions, newregion, &index);
-	// adjust this to be the next closest multiple of 4096
-	as->as_addrPtr = vaddr + memsize;
-	if (as->as_addrPtr % PAGE_SIZE != 0) {
-		as->as_addrPtr = ((as->as_addrPtr / PAGE_SIZE) + 1) * PAGE_SIZE;
-		// an ugly way round it to a multiple of 4096
-	}
-	/*kprintf("New region created : as id : %d start = %x, end = %x, addrPtr = %x\n",
-			as->as_id, newregion->rg_vaddr, newregion->rg_vaddr + newregion->rg_size,
-			as->as_addrPtr);*/
+	struct region newregion;
+	newregion.executable = executable != 0;
+	newregion.readable = readable != 0;
+	newregion.writeable = writeable != 0;
+	newregion.mmapped = 0;
+	newregion.shared = 0;
+	newregion.rg_size = memsize;
+	newregion.rg_vaddr = vaddr;
+	newregion.rg_vnode = NULL;
+	newregion.rg_offset = 0;
+	newregion.rg_filesize = 0;
+	return as_region_add(as, newregion);
+}
+
+/*
+ * Executable segments are not read at exec time. Their pages are read
+ * from the file by as_fill_page when first touched, and pages past the
+ * file contents (bss) are zero filled like anonymous memory.
+ */
+int as_define_file_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		size_t filesize, struct vnode *v, off_t offset, int readable,
+		int writeable, int executable) {
+	struct region newregion;
+	newregion.executable = executable != 0;
+	newregion.readable = readable != 0;
+	newregion.writeable = writeable != 0;
+	newregion.mmapped = 0;
+	newregion.shared = 0;
+	newregion.rg_size = memsize;
+	newregion.rg_vaddr = vaddr;
+	newregion.rg_vnode = v;
+	newregion.rg_offset = offset;
+	newregion.rg_filesize = filesize < memsize ? filesize : memsize;
+	int result = as_region_add(as, newregion);
+	if (result) {
+		return result;
+	}
+	VOP_INCREF(v);
+	return 0;
+}
+
+/*
+ * Mappings are demand paged through as_fill_page like executables, with
+ * V NULL for anonymous memory. Dirty pages of a shared mapping are
+ * written back by vm_msync.
+ */
+int as_define_mapping(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		size_t filesize, struct vnode *v, off_t offset, int readable,
+		int writeable, int executable, int shared) {
+	KASSERT(vaddr % PAGE_SIZE == 0 && memsize % PAGE_SIZE == 0);
+	KASSERT(v != NULL || !shared);
+	struct region newregion;
+	newregion.executable = executable != 0;
+	newregion.readable = readable != 0;
+	newregion.writeable = writeable != 0;
+	newregion.mmapped = 1;
+	newregion.shared = shared != 0;
+	newregion.rg_size = memsize;
+	newregion.rg_vaddr = vaddr;
+	newregion.rg_vnode = v;
+	newregion.rg_offset = offset;
+	newregion.rg_filesize = v == NULL ? 0 : (filesize < memsize ? filesize : memsize);
+	int result = as_region_add(as, newregion);
+	if (result) {
+		return result;
+	}
+	if (v != NULL) {
+		VOP_INCREF(v);
+	}
+	return 0;
+}
+
+int as_set_break(struct addrspace *as, vaddr_t brk) {
+	KASSERT(brk % PAGE_SIZE == 0 && brk >= as->as_heapBase);
+	if (as->as_heap == NULL) {
+		struct region* reg = (struct region*) kmalloc(sizeof(struct region));
+		if (reg == NULL) {
+			return ENOMEM;
+		}
+		reg->readable = 1;
+		reg->writeable = 1;
+		reg->executable = 0;
+		reg->mmapped = 0;
+		reg->shared = 0;
+		reg->rg_vaddr = as->as_heapBase;
+		reg->rg_size = 0;
+		reg->rg_vnode = NULL;
+		reg->rg_offset = 0;
+		reg->rg_filesize = 0;
+		if (as_region_insert(as, as_region_lowerbound(as, reg->rg_vaddr), reg)) {
+			kfree(reg);
+			return ENOMEM;
+		}
+		as->as_heap = reg;
+	}
+	// the region keeps its place in the sorted list, only its end moves
+	as->as_heap->rg_size = brk - as->as_heap->rg_vaddr;
+	as->as_addrPtr = brk;
+	return 0;
+}
+
+bool as_range_free(struct addrspace *as, vaddr_t vaddr, size_t size) {
+	// only the last region starting below the end can overlap
+	unsigned idx = as_region_lowerbound(as, vaddr + size);
+	if (idx == 0) {
+		return true;
+	}
+	struct region* reg = array_get(as->as_regions, idx - 1);
+	return ROUNDUP(reg->rg_vaddr + reg->rg_size, PAGE_SIZE) <= vaddr;
+}
+
+bool as_range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end) {
+	vaddr_t vaddr = start;
+	while (vaddr < end) {
+		struct region* reg = as_find_region(as, vaddr);
+		if (reg == NULL) {
+			return false;
+		}
+		vaddr = ROUNDUP(reg->rg_vaddr + reg->rg_size, PAGE_SIZE);
+	}
+	return true;
+}
+
+vaddr_t as_find_free_range(struct addrspace *as, vaddr_t hint, size_t size) {
+	KASSERT(size % PAGE_SIZE == 0);
+	vaddr_t limit = as->as_stackBase != 0 ? as->as_stackBase : USERSPACETOP;
+	if (hint != 0 && hint % PAGE_SIZE == 0 && hint >= as->as_addrPtr
+			&& hint <= limit && size <= limit - hint
+			&& as_range_free(as, hint, size)) {
+		return hint;
+	}
+	// first fit walking down from the stack, stopping at the heap break
+	vaddr_t top = limit;
+	unsigned idx = as_region_lowerbound(as, top);
+	while (top >= as->as_addrPtr && top - as->as_addrPtr >= size) {
+		vaddr_t start = top - size;
+		if (idx == 0) {
+			return start;
+		}
+		struct region* reg = array_get(as->as_regions, idx - 1);
+		if (ROUNDUP(reg->rg_vaddr + reg->rg_size, PAGE_SIZE) <= start) {
+			return start;
+		}
+		top = reg->rg_vaddr & PAGE_FRAME;
+		idx--;
+	}
+	return 0;
+}
+
+/* Drop the part of a region below newstart, keeping its file offsets right */
+static void as_region_trimfront(struct region* reg, vaddr_t newstart) {
+	size_t delta = newstart - reg->rg_vaddr;
+	reg->rg_vaddr = newstart;
+	reg->rg_size -= delta;
+	reg->rg_offset += delta;
+	reg->rg_filesize = reg->rg_filesize > delta ? reg->rg_filesize - delta : 0;
+}
+
+int as_remove_mapping(struct addrspace *as, vaddr_t start, vaddr_t end) {
+	KASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+	// the regions overlapping the range are first..last-1
+	unsigned first = as_region_lowerbound(as, start);
+	unsigned last = as_region_lowerbound(as, end);
+	if (first > 0) {
+		struct region* prev = array_get(as->as_regions, first - 1);
+		if (prev->rg_vaddr + prev->rg_size > start) {
+			first--;
+		}
+	}
+	unsigned i;
+	struct region* tail = NULL;
+	for (i = first; i < last; i++) {
+		struct region* reg = array_get(as->as_regions, i);
+		if (!reg->mmapped) {
+			return EINVAL;
+		}
+		if (reg->rg_vaddr < start && reg->rg_vaddr + reg->rg_size > end) {
+			// punching a hole, the part above it becomes a region of its own
+			tail = (struct region*) kmalloc(sizeof(struct region));
+			if (tail == NULL) {
+				return ENOMEM;
+			}
+			*tail = *reg;
+			as_region_trimfront(tail, end);
+			if (as_region_insert(as, last, tail)) {
+				kfree(tail);
+				return ENOMEM;
+			}
+			if (tail->rg_vnode != NULL) {
+				VOP_INCREF(tail->rg_vnode);
+			}
+		}
+	}
+
+	vm_msync(as, start, end);
+	vm_unmap(as, start, end);
+
+	for (i = last; i-- > first;) {
+		struct region* reg = array_get(as->as_regions, i);
+		if (reg->rg_vaddr >= start && reg->rg_vaddr + reg->rg_size <= end) {
+			if (reg->rg_vnode != NULL) {
+				VOP_DECREF(reg->rg_vnode);
+			}
+			array_remove(as->as_regions, i);
+			kfree(reg);
+		} else if (reg->rg_vaddr < start) {
+			reg->rg_size = start - reg->rg_vaddr;
+			if (reg->rg_filesize > reg->rg_size) {
+				reg->rg_filesize = reg->rg_size;
+			}
+		} else {
+			as_region_trimfront(reg, end);
+		}
+	}
+	return 0;
+}
+
+int as_fill_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr) {
+	vaddr_t pagestart = vaddr & PAGE_FRAME;
+	vaddr_t pageend = pagestart + PAGE_SIZE;
+	// regions don't overlap, so walk down from the last one starting in the page
+	unsigned idx = as_region_lowerbound(as, pageend);
+	while (idx > 0) {
+		struct region* reg = array_get(as->as_regions, --idx);
+		if (reg->rg_vaddr + reg->rg_size <= pagestart) {
+			break;
+		}
+		if (reg->rg_vnode == NULL) {
+			continue;
+		}
+		vaddr_t start = reg->rg_vaddr > pagestart ? reg->rg_vaddr : pagestart;
+		vaddr_t end = reg->rg_vaddr + reg->rg_filesize;
+		if (end > pageend) {
+			end = pageend;
+		}
+		if (start >= end) {
+			// only bss in this page
+			continue;
+		}
+
+		struct iovec iov;
+		struct uio ku;
+		uio_kinit(&iov, &ku, (void*) (PADDR_TO_KVADDR(paddr) + (start - pagestart)),
+				end - start, reg->rg_offset + (start - reg->rg_vaddr), UIO_READ);
+		int result = VOP_READ(reg->rg_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("ELF: short read on page fault - file truncated?\n");
+			return ENOEXEC;
+		}
+	}
 	return 0;
 }
 
@@ -254,20 +738,22 @@ int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
 }
 
 struct page* page_create(struct addrspace* as, vaddr_t faultaddress) {
-	struct page* newpage = (struct page*) kmalloc(sizeof(struct page));
-	newpage->pt_virtbase = faultaddress / PAGE_SIZE;
-	newpage->pt_pagebase = coremap_allocuserpages(1, as) / PAGE_SIZE;
-	newpage->pt_state = PT_STATE_MAPPED;
-	if(newpage->pt_pagebase == 0) {
-		kfree(newpage);
+	paddr_t paddr = coremap_allocuserpages(1, as);
+	if(paddr == 0) {
+		return NULL;
+	}
+	// fill before the pte is set, until then the pageout thread ignores the frame
+	if(as_fill_page(as, faultaddress, paddr)) {
+		coremap_freeuserpages(paddr);
 		return NULL;
 	}
-	unsigned int idx;
-	/*if(as->as_pagetable->max - 1 == array_num(as->as_pagetable)) {
-		int size = array_num(as->as_pagetable);
-		array_preallocate(as->as_pagetable, size*2);
-	}*/
-	array_add(as->as_pagetable, newpage, &idx);
+	struct page* newpage = pagetable_insert(as->as_pagetable, faultaddress & PAGE_FRAME);
+	if(newpage == NULL) {
+		coremap_freeuserpages(paddr);
+		return NULL;
+	}
+	newpage->pt_pagebase = paddr / PAGE_SIZE;
+	newpage->pt_state = PT_STATE_MAPPED;
+	coremap_setpte(paddr, newpage);
 	return newpage;
 }
-
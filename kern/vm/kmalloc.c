@@ -30,6 +30,8 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 #include <kern/test161.h>
 #include <test.h>
@@ -162,10 +164,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages. Most allocations and frees don't get
+ * this far, they are served from per-cpu magazines (see below) that
+ * take the lock only to move blocks in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -347,6 +348,56 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Map from kernel heap page to its pageref, so that kfree finds the
+ * block size without walking allbase. One entry per physical page,
+ * holding the pageref's index plus one, or 0 for pages that aren't
+ * subpage pages. The map is allocated a page at a time as the heap
+ * reaches new memory, and never freed.
+ *
+ * An entry only changes, under kmalloc_spinlock, while no block of its
+ * page is allocated. So it can be read without the lock for a block
+ * that is being freed.
+ */
+#define PRMAP_PER_PAGE (PAGE_SIZE / sizeof(uint16_t))
+/* kseg0, where kernel heap pages live, maps at most 512M */
+#define PRMAP_PAGES (512*1024*1024 / PAGE_SIZE / PRMAP_PER_PAGE)
+
+static uint16_t *prmap[PRMAP_PAGES];
+static unsigned prmap_npages;
+
+/*
+ * Per-cpu magazines: a small stack of free blocks of each size in
+ * front of the pages, so most kmalloc and kfree calls only take their
+ * own cpu's lock. An empty magazine is refilled with KMAG_BATCH blocks
+ * and a full one gives KMAG_BATCH back, each with a single
+ * acquisition of kmalloc_spinlock. To the pages, a block in a magazine
+ * is an allocated block.
+ *
+ * Guard bands and labels are set up and checked as blocks go through
+ * the pages, so magazines are not used with GUARDS or LABELS.
+ */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+#define KMAG_MAXCPUS 32
+#define KMAG_SIZE 16
+#define KMAG_BATCH 8
+
+struct kmag {
+	struct spinlock km_lock;
+	unsigned km_count[NSIZES];
+	void *km_blocks[NSIZES][KMAG_SIZE];
+};
+
+/* zero filled, which is SPINLOCK_INITIALIZER for the locks */
+static struct kmag kmags[KMAG_MAXCPUS];
+#endif
+
+static void kmag_drainall(void);
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -807,6 +858,9 @@ kheap_printstats(void)
 {
 	struct pageref *pr;
 
+	/* blocks in the magazines would show as allocated */
+	kmag_drainall();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -830,12 +884,17 @@ kheap_getused(void) {
 	unsigned long total = 0;
 	unsigned int num_pages = 0, coremap_bytes = 0;
 
+	/* blocks in the magazines would show as leaked */
+	kmag_drainall();
+
 	/* compute with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		total += subpage_stats(pr, true);
 		num_pages++;
 	}
+	/* the pageref map isn't heap either */
+	num_pages += prmap_npages;
 
 	coremap_bytes = coremap_used_bytes();
 
@@ -914,6 +973,382 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Return the index of a pageref, for the pageref map.
+ */
+static
+unsigned
+pagerefindex(struct pageref *pr)
+{
+	unsigned whichroot;
+	size_t j;
+
+	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+		if (kheaproots[whichroot].page == NULL) {
+			continue;
+		}
+		j = pr - kheaproots[whichroot].page->refs;
+		/* note: j is unsigned, don't test < 0 */
+		if (j < NPAGEREFS_PER_PAGE) {
+			return whichroot * NPAGEREFS_PER_PAGE + j;
+		}
+	}
+	panic("kmalloc: pageref %p not on any pageref page\n", pr);
+	return 0;
+}
+
+/*
+ * Make sure the pageref map covers the page at PRPAGE. Returns false if
+ * there's no memory for it.
+ */
+static
+bool
+prmap_ensure(vaddr_t prpage)
+{
+	unsigned pn = (prpage - PADDR_TO_KVADDR(0)) / PAGE_SIZE;
+	unsigned which = pn / PRMAP_PER_PAGE;
+	vaddr_t va;
+
+	KASSERT(which < PRMAP_PAGES);
+	if (prmap[which] != NULL) {
+		return true;
+	}
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return false;
+	}
+	bzero((void *)va, PAGE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (prmap[which] != NULL) {
+		/* Somebody else got there first. */
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(va);
+		return true;
+	}
+	prmap[which] = (uint16_t *)va;
+	prmap_npages++;
+	spinlock_release(&kmalloc_spinlock);
+	return true;
+}
+
+/*
+ * Set the pageref map entry of the page at PRPAGE, 0 for none. Called
+ * with kmalloc_spinlock held, after prmap_ensure.
+ */
+static
+void
+prmap_set(vaddr_t prpage, unsigned value)
+{
+	unsigned pn = (prpage - PADDR_TO_KVADDR(0)) / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(prmap[pn / PRMAP_PER_PAGE] != NULL);
+	KASSERT(value <= TOTAL_PAGEREFS);
+	prmap[pn / PRMAP_PER_PAGE][pn % PRMAP_PER_PAGE] = value;
+}
+
+/*
+ * Find the pageref of the heap page containing ADDR, or NULL if it is
+ * not a subpage page. Needs no lock if ADDR is an allocated block.
+ */
+static
+struct pageref *
+prmap_lookup(vaddr_t addr)
+{
+	unsigned pn = (addr - PADDR_TO_KVADDR(0)) / PAGE_SIZE;
+	uint16_t *chunk;
+	unsigned index;
+
+	/* addresses below kseg0 wrap around to large page numbers */
+	if (pn >= PRMAP_PAGES * PRMAP_PER_PAGE) {
+		return NULL;
+	}
+	chunk = prmap[pn / PRMAP_PER_PAGE];
+	if (chunk == NULL || chunk[pn % PRMAP_PER_PAGE] == 0) {
+		return NULL;
+	}
+	index = chunk[pn % PRMAP_PER_PAGE] - 1;
+	return &kheaproots[index / NPAGEREFS_PER_PAGE].page->refs[index % NPAGEREFS_PER_PAGE];
+}
+
+/*
+ * Take a block off the free list of a page. Called with
+ * kmalloc_spinlock held.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at PTRADDR back on the free list of its page. If that
+ * leaves the page entirely free, the page is dropped from the lists
+ * and its address is returned, for the caller to free_kpages once it
+ * has released kmalloc_spinlock. Otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
+	offset = ptraddr - prpage;
+
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)ptraddr);
+	}
+
+#ifdef GUARDS
+	blocksize = sizes[blktype];
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		prmap_set(prpage, 0);
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+#ifdef MAGAZINES
+
+static
+struct kmag *
+kmag_mine(void)
+{
+	KASSERT(curcpu->c_number < KMAG_MAXCPUS);
+	return &kmags[curcpu->c_number];
+}
+
+/*
+ * Move up to KMAG_BATCH blocks of the magazine's size BLKTYPE from
+ * pages that have free ones. Doesn't make new pages, that is left to
+ * subpage_kmalloc. Called with the magazine's lock held.
+ */
+static
+void
+kmag_refill(struct kmag *km, unsigned blktype)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (pr = sizebases[blktype];
+	     pr != NULL && km->km_count[blktype] < KMAG_BATCH;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+		while (pr->nfree > 0 && km->km_count[blktype] < KMAG_BATCH) {
+			km->km_blocks[blktype][km->km_count[blktype]++] =
+				subpage_takeblock(pr);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Give the oldest N blocks of size BLKTYPE in the magazine back to
+ * their pages. Called with the magazine's lock held; pages that end up
+ * entirely free are released after both locks are dropped, by the
+ * caller, from FREEPAGES.
+ */
+static
+unsigned
+kmag_flush(struct kmag *km, unsigned blktype, unsigned n,
+	   vaddr_t *freepages)
+{
+	unsigned i, nfreepages = 0;
+	void *block;
+	vaddr_t prpage;
+
+	KASSERT(n <= km->km_count[blktype]);
+	if (n == 0) {
+		return 0;
+	}
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		block = km->km_blocks[blktype][i];
+		prpage = subpage_putblock(prmap_lookup((vaddr_t)block),
+					  (vaddr_t)block);
+		if (prpage != 0) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* slide the newer blocks down, they are the ones reused first */
+	for (i=n; i<km->km_count[blktype]; i++) {
+		km->km_blocks[blktype][i - n] = km->km_blocks[blktype][i];
+	}
+	km->km_count[blktype] -= n;
+	return nfreepages;
+}
+
+/*
+ * Take a block of size BLKTYPE from this cpu's magazine, or NULL.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmag *km;
+	void *ret = NULL;
+
+	km = kmag_mine();
+	spinlock_acquire(&km->km_lock);
+	if (km->km_count[blktype] == 0) {
+		kmag_refill(km, blktype);
+	}
+	if (km->km_count[blktype] > 0) {
+		ret = km->km_blocks[blktype][--km->km_count[blktype]];
+	}
+	spinlock_release(&km->km_lock);
+	return ret;
+}
+
+/*
+ * Put a block of size BLKTYPE in this cpu's magazine.
+ */
+static
+void
+kmag_free(void *block, unsigned blktype)
+{
+	struct kmag *km;
+	vaddr_t freepages[KMAG_BATCH];
+	unsigned i, nfreepages = 0;
+
+	/* As subpage_putblock would. */
+	fill_deadbeef(block, sizes[blktype]);
+
+	km = kmag_mine();
+	spinlock_acquire(&km->km_lock);
+	if (km->km_count[blktype] == KMAG_SIZE) {
+		nfreepages = kmag_flush(km, blktype, KMAG_BATCH, freepages);
+	}
+	km->km_blocks[blktype][km->km_count[blktype]++] = block;
+	spinlock_release(&km->km_lock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Give every block in every magazine back to the pages, so that the
+ * heap statistics see them as free.
+ */
+static
+void
+kmag_drainall(void)
+{
+#ifdef MAGAZINES
+	vaddr_t freepages[KMAG_SIZE];
+	unsigned cpu, blktype, i, nfreepages;
+	struct kmag *km;
+
+	for (cpu=0; cpu<KMAG_MAXCPUS; cpu++) {
+		km = &kmags[cpu];
+		for (blktype=0; blktype<NSIZES; blktype++) {
+			spinlock_acquire(&km->km_lock);
+			nfreepages = kmag_flush(km, blktype,
+						km->km_count[blktype],
+						freepages);
+			spinlock_release(&km->km_lock);
+			for (i=0; i<nfreepages; i++) {
+				free_kpages(freepages[i]);
+			}
+		}
+	}
+#endif
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -955,6 +1390,16 @@ subpage_kmalloc(size_t sz
 	sz = sizes[blktype];
 #endif
 
+#ifdef MAGAZINES
+	/* curcpu isn't there yet for the allocations made while booting */
+	if (CURCPU_EXISTS()) {
+		retptr = kmag_alloc(blktype);
+		if (retptr != NULL) {
+			return retptr;
+		}
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -969,25 +1414,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1023,6 +1450,11 @@ subpage_kmalloc(size_t sz
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
 #endif
+	if (!prmap_ensure(prpage)) {
+		free_kpages(prpage);
+		silent("kmalloc: Subpage allocator couldn't map a page\n");
+		return NULL;
+	}
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
@@ -1035,6 +1467,7 @@ subpage_kmalloc(size_t sz
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
+	prmap_set(prpage, pagerefindex(pr) + 1);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
 
 	/*
@@ -1073,16 +1506,9 @@ static
 int
 subpage_kfree(void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
+	vaddr_t prpage;		// page to release, if it becomes free
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1109,90 +1535,37 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = prmap_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+#ifdef MAGAZINES
+	if (CURCPU_EXISTS()) {
+		unsigned blktype = PR_BLOCKTYPE(pr);
+		vaddr_t offset = ptraddr - PR_PAGEADDR(pr);
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+		if (offset % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		kmag_free(ptr, blktype);
+		return 0;
 	}
-
-#ifdef GUARDS
-	blocksize = sizes[blktype];
-	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
-
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	spinlock_acquire(&kmalloc_spinlock);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	checksubpages();
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+	prpage = subpage_putblock(pr, ptraddr);
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	spinlock_release(&kmalloc_spinlock);
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (prpage != 0) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -16,7 +16,14 @@
 #include <vfs.h>
 #include <stat.h>
 #include <uio.h>
-#include <current.h>
+#include <cpu.h>
+#include <thread.h>
+#include <wchan.h>
+#include <membar.h>
+#include <copyinout.h>
+#include <clock.h>
+#include <kern/mman.h>
+#include <zswap.h>
 
 // core map data structure
 struct core_map_entry* coremap;
@@ -32,7 +39,64 @@ unsigned page_count;
 
 unsigned coremap_pages_free;
 
-#define COREMAP(i) (struct core_map_entry *)(coremap + i)
+#define COREMAP(i) ((struct core_map_entry *)(coremap + (i)))
+
+/*
+ * Free frames are kept in a binary buddy allocator. A free block of order k
+ * covers 2^k frames starting at a coremap index that is a multiple of 2^k,
+ * and its first entry is linked into cm_freelist[k].
+ */
+#define CM_MAX_ORDER 20
+#define CM_NONE (-1)
+
+static int cm_freelist[CM_MAX_ORDER + 1];
+
+/*
+ * Single frames zeroed while a cpu is idle, so zero-fill faults don't pay
+ * for the clear. They are taken out of the buddy allocator and are not
+ * counted in coremap_pages_free. Protected by coremap_lock.
+ */
+#define ZERO_POOL_SIZE 32
+
+static unsigned zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_pool_count = 0;
+
+/*
+ * Each cpu keeps a few free single frames so that most page allocations
+ * and frees only take the cpu's own lock. A cache is refilled from, and
+ * drained to, the buddy allocator CM_CPUCACHE_BATCH frames at a time.
+ * Lock order is cache lock, then coremap_lock.
+ *
+ * Frames in a cache are neither used nor in the buddy lists. The entry of
+ * a frame taken from a cache is filled in before its used bit is set, so
+ * the eviction scan, which only looks at used frames, never sees it half
+ * initialized.
+ */
+#define CM_MAXCPUS 32
+#define CM_CPUCACHE_SIZE 32
+#define CM_CPUCACHE_BATCH 16
+
+struct cm_cpucache {
+	struct spinlock cc_lock;
+	unsigned cc_count;
+	unsigned cc_frames[CM_CPUCACHE_SIZE];
+};
+
+static struct cm_cpucache cm_cpucache[CM_MAXCPUS];
+
+// set once every cpu is running, curcpu is not usable before that
+static bool cm_cpucache_enabled = false;
+
+// fault and paging counters, see vm_printstats
+static struct vm_stats vmstats;
+static struct spinlock vmstats_lock = SPINLOCK_INITIALIZER;
+
+#define VMSTAT_ADD(field, n) do { \
+		spinlock_acquire(&vmstats_lock); \
+		vmstats.field += (n); \
+		spinlock_release(&vmstats_lock); \
+	} while (0)
+#define VMSTAT_INC(field) VMSTAT_ADD(field, 1)
 
 static void cm_setEntryAddrspaceIdent(struct core_map_entry *entry,
 		struct addrspace * as) {
@@ -40,10 +104,20 @@ static void cm_setEntryAddrspaceIdent(struct core_map_entry *entry,
 	entry->as = as;
 }
 
-static void cm_setEntryChunkStart(struct core_map_entry *entry,
-		unsigned chunk_start) {
+static void cm_setEntryChunkSize(struct core_map_entry *entry,
+		unsigned chunk_npages) {
+
+	entry->chunk_npages = chunk_npages;
+}
+
+static void cm_setEntryPte(struct core_map_entry *entry, struct page* pg) {
 
-	entry->chunk_start = chunk_start;
+	entry->pte = pg;
+}
+
+static struct page* cm_getEntryPte(struct core_map_entry *entry) {
+
+	return entry->pte;
 }
 
 static paddr_t cm_getEntryPaddr(unsigned page_index) {
@@ -57,9 +131,15 @@ static struct addrspace * cm_getEntryAddrspaceIdent(
 	return entry->as;
 }
 
-static unsigned cm_getEntryChunkStart(struct core_map_entry *entry) {
+static unsigned cm_getEntryChunkSize(struct core_map_entry *entry) {
+
+	return entry->chunk_npages;
+}
+
+static unsigned cm_getEntryIndex(paddr_t paddr) {
 
-	return entry->chunk_start;
+	KASSERT(paddr >= first_paddr && paddr < first_paddr + page_count * PAGE_SIZE);
+	return (paddr - first_paddr) / PAGE_SIZE;
 }
 
 static bool cm_isEntryUsed(struct core_map_entry *entry) {
@@ -92,6 +172,17 @@ static void cm_setEntryUseState(struct core_map_entry *entry, bool state) {
 	}
 }
 
+static unsigned cm_getEntryRefcount(struct core_map_entry *entry) {
+
+	return entry->refcount;
+}
+
+static void cm_setEntryRefcount(struct core_map_entry *entry,
+		unsigned refcount) {
+
+	entry->refcount = refcount;
+}
+
 static void cm_setEntryDirtyState(struct core_map_entry *entry, bool state) {
 
 	// update the page_state variable
@@ -102,6 +193,202 @@ static void cm_setEntryDirtyState(struct core_map_entry *entry, bool state) {
 	}
 }
 
+static bool cm_isEntryZeroed(struct core_map_entry *entry) {
+
+	return (entry->page_state & 0x08) > 0;
+}
+
+static void cm_setEntryZeroedState(struct core_map_entry *entry, bool state) {
+
+	if (state) {
+		entry->page_state |= 0x08;
+	} else {
+		entry->page_state &= ~0x08;
+	}
+}
+
+static int cm_getEntrySwapSlot(struct core_map_entry *entry) {
+
+	return entry->swap_slot;
+}
+
+static void cm_setEntrySwapSlot(struct core_map_entry *entry, int slot) {
+
+	entry->swap_slot = slot;
+}
+
+static bool cm_isEntryCached(struct core_map_entry *entry) {
+
+	return (entry->page_state & 0x10) > 0;
+}
+
+/* A dirty frame of a shared file mapping, see cleanSharedPages */
+static bool cm_isEntryFileDirty(struct core_map_entry *entry) {
+
+	return cm_isEntryDirty(entry) && cm_isEntryCached(entry)
+			&& entry->pc_vnode != NULL;
+}
+
+static bool cm_isFreeBlockHead(struct core_map_entry *entry, unsigned order) {
+
+	return (entry->page_state & 0x04) > 0 && entry->order == order;
+}
+
+static void cm_freelistAdd(unsigned idx, unsigned order) {
+	struct core_map_entry *entry = COREMAP(idx);
+	entry->order = order;
+	entry->page_state |= 0x04;
+	entry->prev_free = CM_NONE;
+	entry->next_free = cm_freelist[order];
+	if (cm_freelist[order] != CM_NONE) {
+		COREMAP(cm_freelist[order])->prev_free = idx;
+	}
+	cm_freelist[order] = idx;
+}
+
+static void cm_freelistRemove(unsigned idx) {
+	struct core_map_entry *entry = COREMAP(idx);
+	if (entry->prev_free != CM_NONE) {
+		COREMAP(entry->prev_free)->next_free = entry->next_free;
+	} else {
+		cm_freelist[entry->order] = entry->next_free;
+	}
+	if (entry->next_free != CM_NONE) {
+		COREMAP(entry->next_free)->prev_free = entry->prev_free;
+	}
+	entry->page_state &= ~0x04;
+}
+
+/* smallest order whose block holds npages */
+static unsigned cm_orderFor(unsigned npages) {
+	unsigned order = 0;
+	while ((1U << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/* Return a block to the free lists, coalescing it with its free buddies */
+static void cm_buddyFreeBlock(unsigned idx, unsigned order) {
+	while (order < CM_MAX_ORDER) {
+		unsigned buddy = idx ^ (1U << order);
+		if (buddy + (1U << order) > page_count
+				|| !cm_isFreeBlockHead(COREMAP(buddy), order)) {
+			break;
+		}
+		cm_freelistRemove(buddy);
+		if (buddy < idx) {
+			idx = buddy;
+		}
+		order++;
+	}
+	cm_freelistAdd(idx, order);
+}
+
+/* Free an arbitrary run of frames as the largest aligned blocks that fit */
+static void cm_buddyFreeRange(unsigned idx, unsigned npages) {
+	while (npages > 0) {
+		unsigned order = 0;
+		while (order < CM_MAX_ORDER && (idx & (1U << order)) == 0
+				&& (2U << order) <= npages) {
+			order++;
+		}
+		cm_buddyFreeBlock(idx, order);
+		idx += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Text page cache. Read only executable pages are shared by every process
+ * running the binary, copy-on-write like after a fork, so the coremap
+ * refcount counts the processes mapping the frame. The cache holds no
+ * reference itself: a frame leaves it when it is freed, evicted, or taken
+ * over by its last user for writing. Chained through next_free/prev_free
+ * and protected by coremap_lock. Page merging keeps its shared frames
+ * here too, under a NULL vnode and their checksum as the page number.
+ * So do MAP_SHARED file mappings, whose frames are mapped writable so
+ * that every process mapping the file sees the same page. Those are
+ * written back to their file rather than to swap, see cleanSharedPages.
+ */
+#define PCACHE_BUCKETS 256
+
+static int pcache_buckets[PCACHE_BUCKETS];
+
+static unsigned pcache_hash(struct vnode* v, unsigned pageno) {
+	return ((uintptr_t) v / sizeof(struct vnode*) + pageno * 31) % PCACHE_BUCKETS;
+}
+
+/* The frame holding page pageno of v, or CM_NONE */
+static int pcache_lookup(struct vnode* v, unsigned pageno) {
+	int idx = pcache_buckets[pcache_hash(v, pageno)];
+	while (idx != CM_NONE && (COREMAP(idx)->pc_vnode != v
+			|| COREMAP(idx)->pc_pageno != pageno)) {
+		idx = COREMAP(idx)->next_free;
+	}
+	return idx;
+}
+
+static void pcache_insert(unsigned idx, struct vnode* v, unsigned pageno) {
+	struct core_map_entry *entry = COREMAP(idx);
+	unsigned bucket = pcache_hash(v, pageno);
+	entry->pc_vnode = v;
+	entry->pc_pageno = pageno;
+	entry->page_state |= 0x10;
+	entry->prev_free = CM_NONE;
+	entry->next_free = pcache_buckets[bucket];
+	if (pcache_buckets[bucket] != CM_NONE) {
+		COREMAP(pcache_buckets[bucket])->prev_free = idx;
+	}
+	pcache_buckets[bucket] = idx;
+}
+
+/* Take the frame out of the cache, if it is in it */
+static void pcache_remove(unsigned idx) {
+	struct core_map_entry *entry = COREMAP(idx);
+	if (!cm_isEntryCached(entry)) {
+		return;
+	}
+	if (entry->prev_free != CM_NONE) {
+		COREMAP(entry->prev_free)->next_free = entry->next_free;
+	} else {
+		pcache_buckets[pcache_hash(entry->pc_vnode, entry->pc_pageno)] =
+				entry->next_free;
+	}
+	if (entry->next_free != CM_NONE) {
+		COREMAP(entry->next_free)->prev_free = entry->prev_free;
+	}
+	entry->page_state &= ~0x10;
+	entry->pc_vnode = NULL;
+}
+
+/*
+ * Take npages contiguous frames off the free lists, splitting a larger
+ * block if needed. Pages beyond npages in the block are given back, so a
+ * 3 page request only holds 3 pages. Returns the coremap index or CM_NONE.
+ */
+static int cm_buddyAlloc(unsigned npages) {
+	unsigned want = cm_orderFor(npages);
+	unsigned order = want;
+	while (order <= CM_MAX_ORDER && cm_freelist[order] == CM_NONE) {
+		order++;
+	}
+	if (order > CM_MAX_ORDER) {
+		return CM_NONE;
+	}
+	unsigned idx = cm_freelist[order];
+	cm_freelistRemove(idx);
+	while (order > want) {
+		order--;
+		cm_freelistAdd(idx + (1U << order), order);
+	}
+	if ((1U << want) > npages) {
+		cm_buddyFreeRange(idx + npages, (1U << want) - npages);
+	}
+	coremap_pages_free -= npages;
+	return idx;
+}
+
 void vm_bootstrap() {
 
 	// get the number of free pages in ram
@@ -144,390 +431,2277 @@ void vm_bootstrap() {
 
 		// let the address space identifier be NULL initially
 		cm_setEntryAddrspaceIdent(COREMAP(i), NULL);
+		cm_setEntryPte(COREMAP(i), NULL);
+		cm_setEntryRefcount(COREMAP(i), 0);
+		cm_setEntrySwapSlot(COREMAP(i), -1);
+		COREMAP(i)->pc_vnode = NULL;
+		COREMAP(i)->merge_sum = 0;
+		COREMAP(i)->page_state = 0;
+
+		// initial chunk size need not be initialized, will be updated when page is allocated
+	}
 
-		// initial chunk start need not be initialized, will be updated when page is allocated
+	// hand every frame to the buddy allocator
+	for (i = 0; i <= CM_MAX_ORDER; i++) {
+		cm_freelist[i] = CM_NONE;
+	}
+	cm_buddyFreeRange(0, page_count);
+	for (i = 0; i < PCACHE_BUCKETS; i++) {
+		pcache_buckets[i] = CM_NONE;
+	}
+
+	for (i = 0; i < CM_MAXCPUS; i++) {
+		spinlock_init(&cm_cpucache[i].cc_lock);
+		cm_cpucache[i].cc_count = 0;
 	}
 
 }
 
 static struct region* findRegionForFaultAddress(struct addrspace* as,
 		vaddr_t address) {
-	int regionCount = array_num(as->as_regions);
-	int i;
-	for (i = 0; i < regionCount; i++) {
-		struct region* reg = array_get(as->as_regions, i);
-		if (reg != NULL && reg->rg_vaddr <= address
-				&& (reg->rg_vaddr + reg->rg_size) > address) {
-			return reg;
-		}
-	}
-	//kprintf("Region count is : %u\n",regionCount);
-	return NULL;
+	return as_find_region(as, address);
 }
 
 static struct page* findPageForFaultAddress(struct addrspace* as,
 		vaddr_t faultaddress) {
-	int pageCount = array_num(as->as_pagetable);
-	int i;
-	for (i = 0; i < pageCount; i++) {
-		struct page *pageCandidate = array_get(as->as_pagetable, i);
-		if (pageCandidate != NULL
-				&& pageCandidate->pt_virtbase == faultaddress / PAGE_SIZE) {
-			return pageCandidate;
-		}
-	}
-	return NULL;
+	return pagetable_lookup(as->as_pagetable, faultaddress & PAGE_FRAME);
 }
 
 #define SWAP_STATE_UNINIT 0
 #define SWAP_STATE_NOSWAP -1
 #define SWAP_STATE_READY 1
 
-#define SWAP_PAGE_FREE 0
-#define SWAP_PAGE_USED 1
+static int swap_state = 0;
 
-struct swap_entry {
-	int se_used;
-	int se_paddr;
-};
+/*
+ * Free frame watermarks for the pageout thread, as fractions of memory.
+ */
+#define PAGEOUT_LOWATER_DIV 32
+#define PAGEOUT_HIWATER_DIV 16
 
-static int swap_state = 0;
+static unsigned pageout_lowater;
+static unsigned pageout_hiwater;
+
+// the pageout thread sleeps here, protected by coremap_lock
+static struct wchan* pageout_wchan = NULL;
 
-static struct swap_entry* swap_map = NULL;
+static void pageout_start(void);
+static void pagemerge_start(void);
+static void reaper_start(void);
+static void loadctl_start(void);
+static void prefetch_start(void);
+static void loadctlWait(struct addrspace* as);
+static void loadctlAccount(const struct timespec* start);
+
+/*
+ * Swap slots are tracked in a bitmap, one bit per page on the swap disk.
+ * Allocation is next fit: it resumes at the word after the last slot
+ * handed out and skips full words 32 slots at a time.
+ */
+#define SWAP_WORD_BITS 32
+#define SWAP_WORD_FULL 0xffffffff
+
+static uint32_t* swap_bitmap = NULL;
+
+static unsigned swap_bitmap_words;
+
+static unsigned swap_hint = 0;
+
+static struct spinlock swap_bitmap_lock = SPINLOCK_INITIALIZER;
 
 static int swap_page_count;
 
-static struct vnode* swap_vnode;
+static unsigned swap_pages_used = 0;
 
 static struct lock* swap_lock;
 
-#define SWAP_DISK_NAME "lhd0raw:"
+/*
+ * Eviction writes up to SWAP_CLUSTER pages per request, looking at most
+ * SWAP_CLUSTER_SCAN more blocks once the first victim is found. A swap
+ * fault reads up to SWAP_READAHEAD pages that were written together.
+ */
+#define SWAP_CLUSTER 16
+#define SWAP_CLUSTER_SCAN 64
+#define SWAP_READAHEAD 8
+// pages read back keep their swap slot while a quarter of the disk is free
+#define SWAP_KEEP_DIV 4
+
+/*
+ * Pages go to a compressed pool in memory before the swap disk, see
+ * zswap.h. The pool takes this fraction of memory, reserved at boot,
+ * and a page for decompressing the ones written out from it.
+ */
+#define ZSWAP_POOL_DIV 8
+
+static bool zswap_enabled = false;
+
+static paddr_t zswap_scratch;
+
+// threads waiting for a page in PT_STATE_INTRANSIT, protected by coremap_lock
+static struct wchan* swap_transit_wchan;
+
+/*
+ * Swap spans lhd0raw: and the disks attached after it, up to
+ * SWAP_MAXDISKS. Slots are striped across them SWAP_STRIPE pages at a
+ * time, so a cluster written or read back together is spread over all
+ * the disks. Each disk has a thread that does its share of a request
+ * while the caller does another share, and every disk gives as many
+ * slots as the smallest one.
+ */
+#define SWAP_MAXDISKS 4
+#define SWAP_STRIPE 4
+
+// the part of a request on one disk, in consecutive slots of that disk
+struct swap_seg {
+	unsigned sg_disk;
+	off_t sg_offset;
+	paddr_t sg_frames[SWAP_CLUSTER];
+	unsigned sg_npages;
+	enum uio_rw sg_rw;
+	int sg_result;
+	unsigned* sg_pending;  // segments of the request the threads haven't done
+	struct swap_seg* sg_next;
+};
+
+struct swap_disk {
+	struct vnode* sd_vnode;
+	struct wchan* sd_wchan;     // the disk's thread waits for segments here
+	struct swap_seg* sd_queue;
+};
+
+static struct swap_disk swap_disks[SWAP_MAXDISKS];
+
+static unsigned swap_ndisks = 0;
+
+// protects the disk queues and the pending counts of requests
+static struct spinlock swap_disk_lock = SPINLOCK_INITIALIZER;
+
+// callers waiting for the disk threads, protected by swap_disk_lock
+static struct wchan* swap_iodone_wchan;
+
+static void swapdisk_thread(void* data1, unsigned long disk);
+
+/* Open the swap disks, returns the number of slots each one gives */
+static unsigned swapOpenDisks(void) {
+	unsigned diskpages = 0;
+	unsigned d;
+	for (d = 0; d < SWAP_MAXDISKS; d++) {
+		char name[16];
+		snprintf(name, sizeof(name), "lhd%uraw:", d);
+		struct vnode* v;
+		int ret = vfs_open(name, O_RDWR, 0, &v);
+		if (ret) {
+			if (d == 0) {
+				kprintf("WARN swap disk not found Ret = %d\n", ret);
+			}
+			break;
+		}
+		struct stat statbuf;
+		ret = VOP_STAT(v, &statbuf);
+		if (ret) {
+			kprintf("ERR Stat on swap disk %u failed\n", d);
+			vfs_close(v);
+			break;
+		}
+		unsigned npages = (statbuf.st_size / PAGE_SIZE) - 1;
+		npages -= npages % SWAP_STRIPE;
+		if (npages == 0) {
+			vfs_close(v);
+			break;
+		}
+		if (swap_ndisks == 0 || npages < diskpages) {
+			diskpages = npages;
+		}
+		swap_disks[swap_ndisks].sd_vnode = v;
+		swap_disks[swap_ndisks].sd_queue = NULL;
+		swap_ndisks++;
+	}
+	if (swap_ndisks < 2) {
+		// one disk is driven by the callers alone
+		return diskpages;
+	}
+	swap_iodone_wchan = wchan_create("swap_iodone");
+	if (swap_iodone_wchan == NULL) {
+		panic("swap_init: out of memory\n");
+	}
+	for (d = 0; d < swap_ndisks; d++) {
+		swap_disks[d].sd_wchan = wchan_create("swapdisk");
+		if (swap_disks[d].sd_wchan == NULL
+				|| thread_fork("swapdisk", NULL, swapdisk_thread, NULL, d)) {
+			panic("swap_init: can't start the swap disk threads\n");
+		}
+	}
+	return diskpages;
+}
+
+static void zswapInit(void) {
+	unsigned npages = page_count / ZSWAP_POOL_DIV;
+	if (npages == 0) {
+		return;
+	}
+	vaddr_t pool = alloc_kpages(npages);
+	vaddr_t scratch = alloc_kpages(1);
+	if (pool == 0 || scratch == 0) {
+		kprintf("WARN No memory for the compressed swap pool\n");
+		if (pool != 0) {
+			free_kpages(pool);
+		}
+		if (scratch != 0) {
+			free_kpages(scratch);
+		}
+		return;
+	}
+	if (zswap_init((void*) pool, npages * PAGE_SIZE, swap_page_count)) {
+		kprintf("WARN No memory for the compressed swap pool\n");
+		free_kpages(pool);
+		free_kpages(scratch);
+		return;
+	}
+	zswap_scratch = scratch - MIPS_KSEG0;
+	zswap_enabled = true;
+	kprintf("Compressed swap pool: %u pages\n", npages);
+}
 
 void swap_init() {
-	int ret = vfs_open((char*) SWAP_DISK_NAME, O_RDWR, 0, &swap_vnode);
-	if (ret) {
-		kprintf("WARN swap disk not found Ret = %d\n", ret);
+	// called after thread_start_cpus, so curcpu is valid on every cpu
+	cm_cpucache_enabled = true;
+	pagemerge_start();
+	reaper_start();
+
+	unsigned diskpages = swapOpenDisks();
+	if (swap_ndisks == 0) {
 		swap_state = SWAP_STATE_NOSWAP;
 		return;
 	}
-	struct stat statbuf;
-	ret = VOP_STAT(swap_vnode, &statbuf);
-	if (ret) {
-		kprintf("ERR Stat on swap disk failed\n");
+
+	swap_page_count = swap_ndisks * diskpages;
+	swap_bitmap_words = DIVROUNDUP(swap_page_count, SWAP_WORD_BITS);
+	swap_bitmap = (uint32_t*) kmalloc(sizeof(uint32_t) * swap_bitmap_words);
+	if (swap_bitmap == NULL) {
+		kprintf("ERR No memory for the swap bitmap\n");
 		swap_state = SWAP_STATE_NOSWAP;
 		return;
 	}
+	bzero(swap_bitmap, sizeof(uint32_t) * swap_bitmap_words);
 
-	swap_page_count = (statbuf.st_size / PAGE_SIZE) - 1;
-	swap_map = (struct swap_entry*) kmalloc(
-			sizeof(struct swap_entry) * swap_page_count);
-
+	// the bits past the end of the disk are never free
 	int i;
-	for (i = 0; i < swap_page_count; i++) {
-		swap_map[i].se_used = SWAP_PAGE_FREE;
-		swap_map[i].se_paddr = i;
+	for (i = swap_page_count; i < (int) (swap_bitmap_words * SWAP_WORD_BITS); i++) {
+		swap_bitmap[i / SWAP_WORD_BITS] |= (uint32_t) 1 << (i % SWAP_WORD_BITS);
 	}
 
 	swap_lock = lock_create("swap_lock");
+	swap_transit_wchan = wchan_create("swap_transit");
+	if (swap_lock == NULL || swap_transit_wchan == NULL) {
+		panic("swap_init: out of memory\n");
+	}
+
+	zswapInit();
 
 	swap_state = SWAP_STATE_READY;
-	kprintf("Swap init done. Total available pages = %d\n", swap_page_count);
+	kprintf("Swap init done. Total available pages = %d on %u disks\n",
+			swap_page_count, swap_ndisks);
 
-}
+	pageout_start();
+	loadctl_start();
+	prefetch_start();
 
-int swap_prev_write_idx = 0;
+}
 
-#define SWAP_IDX(idx) ((int)idx % (int)page_count)
-#define COREMAP_SWAP(i) COREMAP(SWAP_IDX(i + swap_prev_write_idx))
+// clock hand for page replacement, the coremap index the next sweep starts at
+static unsigned clock_hand = 0;
 
-static int getOneSwapPage() {
-	int i = 0;
-	for (i = 0; i < swap_page_count; i++) {
-		if (swap_map[i].se_used == SWAP_PAGE_FREE) {
-			swap_map[i].se_used = SWAP_PAGE_USED;
-			return i;
+/*
+ * Allocate a run of consecutive swap slots, at most want long, so that a
+ * cluster of pages can go to disk in one request. The run starts at the
+ * first free slot found by the next fit search and is extended while the
+ * following slots are free. Returns the first slot and sets *got, or -1
+ * if the disk is full.
+ */
+static int getSwapRun(unsigned want, unsigned* got) {
+	KASSERT(want > 0);
+	spinlock_acquire(&swap_bitmap_lock);
+	unsigned n;
+	for (n = 0; n < swap_bitmap_words; n++) {
+		unsigned w = (swap_hint + n) % swap_bitmap_words;
+		uint32_t word = swap_bitmap[w];
+		if (word == SWAP_WORD_FULL) {
+			continue;
+		}
+		unsigned bit = 0;
+		while (word & ((uint32_t) 1 << bit)) {
+			bit++;
 		}
+		unsigned first = w * SWAP_WORD_BITS + bit;
+		unsigned slot = first;
+		// the bits past the end of the disk are set, so this stops there
+		while (slot - first < want && slot < swap_bitmap_words * SWAP_WORD_BITS
+				&& !(swap_bitmap[slot / SWAP_WORD_BITS]
+						& ((uint32_t) 1 << (slot % SWAP_WORD_BITS)))) {
+			swap_bitmap[slot / SWAP_WORD_BITS] |= (uint32_t) 1
+					<< (slot % SWAP_WORD_BITS);
+			slot++;
+		}
+		*got = slot - first;
+		swap_pages_used += *got;
+		// resume at the word holding the first slot after the run
+		w = slot / SWAP_WORD_BITS;
+		swap_hint = w < swap_bitmap_words ? w : 0;
+		spinlock_release(&swap_bitmap_lock);
+		return first;
 	}
+	spinlock_release(&swap_bitmap_lock);
+	*got = 0;
 	return -1;
 }
 
-static struct page* findPageFromCoreMap(struct core_map_entry* cm, int idx) {
-	int num = array_num(cm->as->as_pagetable);
-	int i;
-	for (i = 0; i < num; i++) {
-		struct page* pg = array_get(cm->as->as_pagetable, i);
-		if (pg->pt_pagebase == cm_getEntryPaddr(idx) / PAGE_SIZE) {
-			return pg;
-		}
+static void freeOneSwapPage(int swapPageindex) {
+	KASSERT(swapPageindex >= 0 && swapPageindex < swap_page_count);
+	// before the slot can be handed out again
+	if (zswap_enabled) {
+		zswap_invalidate(swapPageindex);
 	}
-	panic("couldnt find page in address space\n");
-	return NULL;
-
+	uint32_t mask = (uint32_t) 1 << (swapPageindex % SWAP_WORD_BITS);
+	spinlock_acquire(&swap_bitmap_lock);
+	KASSERT(swap_bitmap[swapPageindex / SWAP_WORD_BITS] & mask);
+	swap_bitmap[swapPageindex / SWAP_WORD_BITS] &= ~mask;
+	swap_pages_used--;
+	spinlock_release(&swap_bitmap_lock);
 }
 
-static void swaponepageout(struct page* pg, paddr_t phyaddr) {
-	int swapPageindex = pg->pt_pagebase;
-	struct iovec iov;
-	struct uio kuio;
-	iov.iov_kbase = (void*) PADDR_TO_KVADDR(phyaddr);
-	iov.iov_len = PAGE_SIZE; // length of the memory space
-	kuio.uio_iov = &iov;
-	kuio.uio_iovcnt = 1;
-	kuio.uio_resid = PAGE_SIZE; // amount to write to the file
-	kuio.uio_space = NULL;
-	kuio.uio_offset = swap_map[swapPageindex].se_paddr * PAGE_SIZE;
-	kuio.uio_segflg = UIO_SYSSPACE;
-	kuio.uio_rw = UIO_READ;
-	// 4. write them to disk
-	int result = VOP_READ(swap_vnode, &kuio);
-	if (result) {
-		// release lock on the vnode
-		panic("READ FAILED!\n");
-		return;
+/*
+ * Forget the swap copy of a frame that is about to be written or freed.
+ * Called with coremap_lock held, or for a frame only the caller can reach.
+ */
+static void cm_dropSwapCopy(unsigned idx) {
+	int slot = cm_getEntrySwapSlot(COREMAP(idx));
+	if (slot >= 0) {
+		cm_setEntrySwapSlot(COREMAP(idx), -1);
+		freeOneSwapPage(slot);
 	}
+}
 
-	swap_map[swapPageindex].se_used = SWAP_PAGE_FREE;
-	kprintf("Swap out:\tswap= %x,\tpage=%x \n",swapPageindex,pg->pt_virtbase);
-	pg->pt_state = PT_STATE_MAPPED;
-	pg->pt_pagebase = phyaddr / PAGE_SIZE;
-
-
+/* Is there room to leave a copy on disk of the pages we read back? */
+static bool swapKeepCopies(void) {
+	return swap_pages_used
+			< (unsigned) (swap_page_count - swap_page_count / SWAP_KEEP_DIV);
 }
 
-static void swaponepagein(int idx, struct addrspace* as) {
-	(void) as;
-	// 3. clear their tlb entries if present TODO
-	cm_setEntryDirtyState(COREMAP(idx),true);
-	struct page* pg = findPageFromCoreMap(COREMAP(idx), idx);
+/*
+ * Drop this cpu's TLB entry for vaddr in the given address space, if
+ * there is one. Entries of every address space may be in the TLB.
+ */
+static void tlb_invalidate(struct addrspace* as, vaddr_t vaddr) {
 	int spl = splhigh();
-	int tlbpos = tlb_probe(pg->pt_pagebase * PAGE_SIZE, 0);
+	int tlbpos = tlb_probe(TLBHI_ASID(vaddr, as->as_asid), 0);
 	if (tlbpos >= 0) {
 		tlb_write(TLBHI_INVALID(tlbpos), TLBLO_INVALID(), tlbpos);
-	} else {
-		//kprintf("was not on tlb\n");
 	}
+	// the probe loaded the other address space's ID
+	tlb_setasid(curcpu->c_asid);
 	splx(spl);
+}
 
-	int swapPageindex = getOneSwapPage();
-	kprintf("Swap in :\tswap= %x,\tpage=%x \n",swapPageindex,pg->pt_virtbase);
-	//kprintf("Swap in page Vaddr = %x\n", pg->pt_virtbase);
-	struct iovec iov;
-	struct uio kuio;
-	iov.iov_kbase = (void*) PADDR_TO_KVADDR(cm_getEntryPaddr(idx));
-	iov.iov_len = PAGE_SIZE; // length of the memory space
-	kuio.uio_iov = &iov;
-	kuio.uio_iovcnt = 1;
-	kuio.uio_resid = PAGE_SIZE; // amount to write to the file
-	kuio.uio_space = NULL;
-	kuio.uio_offset = swap_map[swapPageindex].se_paddr * PAGE_SIZE;
-	kuio.uio_segflg = UIO_SYSSPACE;
-	kuio.uio_rw = UIO_WRITE;
-	//kprintf("before write \n");
-	// 4. write them to disk
-	spinlock_release(&coremap_lock);
-	int result = VOP_WRITE(swap_vnode, &kuio);
-	spinlock_acquire(&coremap_lock);
-	if (result) {
-		// release lock on the vnode
-		panic("WRITE FAILED!\n");
-		return;
-	}
-	cm_setEntryDirtyState(COREMAP(idx),false);
-	//kprintf("write complete\n");
+/*
+ * A batch of TLB invalidations that may span address spaces. Entries are
+ * dropped from this cpu's TLB as they are added, which is safe under a
+ * spinlock. tlb_batch_sync then drops them from every other cpu the
+ * address spaces ran on, one IPI per cpu, and waits for that. It must be
+ * called without spinlocks, and before the frames are reused or written
+ * out.
+ */
+struct tlb_batch {
+	int tb_count; // TLBSHOOTDOWN_ALL once there are too many
+	uint32_t tb_cpumask;
+	struct tlbshootdown tb_entries[TLBSHOOTDOWN_MAX];
+};
 
-	pg->pt_state = PT_STATE_SWAPPED;
-	pg->pt_pagebase = swap_map[swapPageindex].se_paddr;
+static void tlb_batch_init(struct tlb_batch* tb) {
+	tb->tb_count = 0;
+	tb->tb_cpumask = 0;
 }
 
-static void swapin(int npages, struct addrspace* as) {
-	// 1. check if coremap lock is already held, else acquire it
-
-	if (swap_state == SWAP_STATE_NOSWAP) {
-		panic("Attempting to swap in when no swap disk is found!\n");
+static void tlb_batch_add(struct tlb_batch* tb, struct addrspace* as,
+		vaddr_t vaddr) {
+	tlb_invalidate(as, vaddr);
+	uint32_t others = as->as_cpumask & ~((uint32_t) 1 << curcpu->c_number);
+	if (others == 0) {
+		return;
 	}
-	lock_acquire(swap_lock);
-	// 2. select a bunch of non kernel pages.
-	unsigned int i;
+	tb->tb_cpumask |= others;
+	if (tb->tb_count == TLBSHOOTDOWN_MAX) {
+		tb->tb_count = TLBSHOOTDOWN_ALL;
+	} else if (tb->tb_count != TLBSHOOTDOWN_ALL) {
+		tb->tb_entries[tb->tb_count].ts_vaddr = vaddr;
+		tb->tb_entries[tb->tb_count].ts_asid = as->as_asid;
+		tb->tb_count++;
+	}
+}
 
-	for (i = 0; i < page_count; i++) {
-		int i_idx = SWAP_IDX(i + swap_prev_write_idx);
-		if (cm_isEntryUsed(COREMAP(i_idx)) && cm_getEntryAddrspaceIdent(COREMAP(i_idx)) != NULL) {
-			struct page* pg = NULL;
-			if (cm_getEntryAddrspaceIdent(COREMAP(i_idx)) == as) {
-				pg = findPageFromCoreMap(COREMAP(i_idx), i_idx);
-				int spl = splhigh();
-				int tlbpos = tlb_probe(pg->pt_virtbase * PAGE_SIZE, 0);
-				splx(spl);
-				if (tlbpos >= 0) {
-					//kprintf("tlb hit at %x %d\n",pg->pt_pagebase, tlbpos);
-					continue;
-				}
-			}
-			int j = 0;
-			int flag = 1;
-			for (j = 0; j < npages; j++) {
-				int j_idx = SWAP_IDX(i + j + swap_prev_write_idx);
-				if (j_idx >= (int)page_count) {
-					kprintf("page count greater than i+j\n");
-					flag = 0;
-					break;
-				}
-				if (cm_isEntryUsed(
-						COREMAP(j_idx)) && cm_getEntryAddrspaceIdent(COREMAP(j_idx)) == NULL) {
-					kprintf("page used by kernel\n");
-					flag = 0;
-					break;
-				}
-			}
-			if (flag == 1) {
-				for (j = 0; j < npages; j++) {
-					int j_idx = SWAP_IDX(i + j + swap_prev_write_idx);
-					if (cm_isEntryUsed(COREMAP(j_idx)) && cm_getEntryAddrspaceIdent(COREMAP(j_idx)) != NULL) {
-						swaponepagein(j_idx, as);
-						cm_setEntryUseState(COREMAP(j_idx), false);
-						cm_setEntryDirtyState(COREMAP(j_idx), false);
-						// let the address space identifier be NULL initially
-						cm_setEntryAddrspaceIdent(COREMAP(j_idx), NULL);
-						coremap_pages_free++;
-						swap_prev_write_idx = j_idx + 1;
-						/*if(pg != NULL) {
-							kprintf("swapped in page was = %x\n", pg->pt_virtbase);
-						} else {
-							kprintf("page was nill\n");
-						}*/
-					} else {
-						kprintf("How did this get approved?\n");
-					}
-				}
-				//spinlock_acquire(&coremap_lock);
-				lock_release(swap_lock);
-				return;
-			}
-		}
+static void tlb_batch_sync(struct tlb_batch* tb) {
+	if (tb->tb_cpumask != 0) {
+		ipi_tlbshootdown_sync(tb->tb_cpumask, tb->tb_entries, tb->tb_count);
 	}
-	panic("Out of pages to swap out!\n");
-	//spinlock_acquire(&coremap_lock);
-	lock_release(swap_lock);
+	tlb_batch_init(tb);
+}
 
-	// 2.5 Maintain a index of last page that was swapped in so that you swap in the one after that
+static struct page* findPageFromCoreMap(struct core_map_entry* cm, int idx) {
+	struct page* pg = cm_getEntryPte(cm);
+	KASSERT(pg != NULL && pg->pt_valid && pg->pt_state == PT_STATE_MAPPED);
+	KASSERT(pg->pt_pagebase == cm_getEntryPaddr(idx) / PAGE_SIZE);
+	return pg;
+}
 
-	// 5. free lock if you had acquired it in this method
+/*
+ * Wait until the page is no longer being written to swap. Anything that
+ * looks at pt_state or pt_pagebase of a page it did not just fault in
+ * must call this first.
+ */
+static void waitForTransit(struct page* pg) {
+	spinlock_acquire(&coremap_lock);
+	while (pg->pt_state == PT_STATE_INTRANSIT) {
+		wchan_sleep(swap_transit_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
 }
 
-static void swapout(struct addrspace*as, struct page* pg) {
-	if (swap_state == SWAP_STATE_NOSWAP) {
-		panic("Attempting to swap out when no swap disk is found!\n");
+/* Do a segment's transfer, as a single request to its disk */
+static int swapSegmentIo(struct swap_seg* seg) {
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio kuio;
+	unsigned i;
+
+	for (i = 0; i < seg->sg_npages; i++) {
+		iov[i].iov_kbase = (void*) PADDR_TO_KVADDR(seg->sg_frames[i]);
+		iov[i].iov_len = PAGE_SIZE; // length of the memory space
 	}
-	// 2. allocate a page in coremap for this
-	paddr_t phaddress = coremap_allocuserpages(1, as);
-	if (phaddress == 0) {
-		kprintf("no page to swap in to \n");
-		return;
+	kuio.uio_iov = iov;
+	kuio.uio_iovcnt = seg->sg_npages;
+	kuio.uio_resid = seg->sg_npages * PAGE_SIZE; // amount to transfer
+	kuio.uio_space = NULL;
+	kuio.uio_offset = seg->sg_offset;
+	kuio.uio_segflg = UIO_SYSSPACE;
+	kuio.uio_rw = seg->sg_rw;
+	struct vnode* v = swap_disks[seg->sg_disk].sd_vnode;
+	if (seg->sg_rw == UIO_READ) {
+		VMSTAT_INC(vs_swapreads);
+		return VOP_READ(v, &kuio);
 	}
+	VMSTAT_INC(vs_swapwrites);
+	return VOP_WRITE(v, &kuio);
+}
 
-	// 3. copy content from disk to the new page
-	// 4. update page table entry
-	// 5. free the swap page
-	swaponepageout(pg, phaddress);
+static void swapdisk_thread(void* data1, unsigned long disk) {
+	(void) data1;
+	struct swap_disk* sd = &swap_disks[disk];
+
+	spinlock_acquire(&swap_disk_lock);
+	while (true) {
+		while (sd->sd_queue == NULL) {
+			wchan_sleep(sd->sd_wchan, &swap_disk_lock);
+		}
+		struct swap_seg* seg = sd->sd_queue;
+		sd->sd_queue = seg->sg_next;
+		spinlock_release(&swap_disk_lock);
+
+		int result = swapSegmentIo(seg);
+
+		spinlock_acquire(&swap_disk_lock);
+		// the segment is on the caller's stack, gone once pending drops
+		seg->sg_result = result;
+		(*seg->sg_pending)--;
+		wchan_wakeall(swap_iodone_wchan, &swap_disk_lock);
+	}
+}
+
+/*
+ * Transfer npages pages between consecutive swap slots starting at
+ * swapPageindex and the frames in phyaddrs. There is one request per
+ * disk the slots are striped over, all of them in flight together.
+ */
+static int swap_disk_io(int swapPageindex, paddr_t* phyaddrs, unsigned npages,
+		enum uio_rw rw) {
+	struct swap_seg segs[SWAP_MAXDISKS];
+	unsigned nsegs = 0;
+	unsigned i, s;
+
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	for (i = 0; i < npages; i++) {
+		unsigned slot = swapPageindex + i;
+		unsigned stripe = slot / SWAP_STRIPE;
+		unsigned disk = stripe % swap_ndisks;
+		off_t offset = (off_t) ((stripe / swap_ndisks) * SWAP_STRIPE
+				+ slot % SWAP_STRIPE) * PAGE_SIZE;
+		for (s = 0; s < nsegs && segs[s].sg_disk != disk; s++) {
+		}
+		if (s == nsegs) {
+			segs[s].sg_disk = disk;
+			segs[s].sg_offset = offset;
+			segs[s].sg_npages = 0;
+			segs[s].sg_rw = rw;
+			segs[s].sg_result = 0;
+			nsegs++;
+		}
+		// the stripes of a run that land on one disk follow each other there
+		KASSERT(segs[s].sg_offset + segs[s].sg_npages * PAGE_SIZE == offset);
+		segs[s].sg_frames[segs[s].sg_npages++] = phyaddrs[i];
+	}
+
+	// the disk threads take all but the first segment, which we do here
+	unsigned pending = nsegs - 1;
+	if (pending > 0) {
+		spinlock_acquire(&swap_disk_lock);
+		for (s = 1; s < nsegs; s++) {
+			struct swap_disk* sd = &swap_disks[segs[s].sg_disk];
+			segs[s].sg_pending = &pending;
+			segs[s].sg_next = NULL;
+			struct swap_seg** link = &sd->sd_queue;
+			while (*link != NULL) {
+				link = &(*link)->sg_next;
+			}
+			*link = &segs[s];
+			wchan_wakeone(sd->sd_wchan, &swap_disk_lock);
+		}
+		spinlock_release(&swap_disk_lock);
+	}
+	int result = swapSegmentIo(&segs[0]);
+	if (nsegs > 1) {
+		spinlock_acquire(&swap_disk_lock);
+		while (pending > 0) {
+			wchan_sleep(swap_iodone_wchan, &swap_disk_lock);
+		}
+		spinlock_release(&swap_disk_lock);
+		for (s = 1; s < nsegs && !result; s++) {
+			result = segs[s].sg_result;
+		}
+	}
+	return result;
+}
+
+/*
+ * Put the page for the slot in the compressed pool, writing the oldest
+ * pages in the pool to disk until it fits. Returns false if the page
+ * doesn't compress and has to go to disk itself.
+ */
+static bool zswapStore(int swapPageindex, paddr_t phyaddr) {
+	KASSERT(lock_do_i_hold(swap_lock));
+	const void* page = (const void*) PADDR_TO_KVADDR(phyaddr);
+	int result;
+	while ((result = zswap_store(swapPageindex, page)) == ENOSPC) {
+		int slot = zswap_writeback((void*) PADDR_TO_KVADDR(zswap_scratch));
+		if (slot < 0) {
+			return false;
+		}
+		result = swap_disk_io(slot, &zswap_scratch, 1, UIO_WRITE);
+		if (result) {
+			panic("Failed to write compressed page to swap: %d\n", result);
+		}
+		zswap_writeback_done(slot);
+		VMSTAT_INC(vs_zwritebacks);
+	}
+	if (result) {
+		return false;
+	}
+	VMSTAT_INC(vs_zstores);
+	return true;
+}
+
+/*
+ * Transfer npages pages between consecutive swap slots starting at
+ * swapPageindex and the frames in phyaddrs. Pages the compressed pool
+ * holds, or takes on a write, don't reach the disk. The rest go to disk
+ * in one request per run of consecutive slots. Writes need swap_lock.
+ */
+static int swap_io(int swapPageindex, paddr_t* phyaddrs, unsigned npages,
+		enum uio_rw rw) {
+	bool inpool[SWAP_CLUSTER];
+	unsigned i;
+
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	if (!zswap_enabled) {
+		return swap_disk_io(swapPageindex, phyaddrs, npages, rw);
+	}
+	for (i = 0; i < npages; i++) {
+		if (rw == UIO_READ) {
+			inpool[i] = zswap_load(swapPageindex + i,
+					(void*) PADDR_TO_KVADDR(phyaddrs[i]));
+			if (inpool[i]) {
+				VMSTAT_INC(vs_zloads);
+			}
+		} else {
+			inpool[i] = zswapStore(swapPageindex + i, phyaddrs[i]);
+		}
+	}
+	i = 0;
+	while (i < npages) {
+		if (inpool[i]) {
+			i++;
+			continue;
+		}
+		unsigned run = 1;
+		while (i + run < npages && !inpool[i + run]) {
+			run++;
+		}
+		int result = swap_disk_io(swapPageindex + i, &phyaddrs[i], run, rw);
+		if (result) {
+			return result;
+		}
+		i += run;
+	}
+	return 0;
+}
+
+/*
+ * Move a swapped page to PT_STATE_INTRANSIT, so that nobody else reads it
+ * back at the same time. Returns false if it is no longer in the slot.
+ */
+static bool claimSwapped(struct page* pg, int swapPageindex) {
+	spinlock_acquire(&coremap_lock);
+	// an unmapped page keeps its state, but its slot may be reused
+	bool claimed = pg->pt_valid && pg->pt_state == PT_STATE_SWAPPED
+			&& (int) pg->pt_pagebase == swapPageindex;
+	if (claimed) {
+		pg->pt_state = PT_STATE_INTRANSIT;
+	}
+	spinlock_release(&coremap_lock);
+	return claimed;
+}
+
+/*
+ * Read the page back from swap into the frame at phyaddr. The pages that
+ * follow it in the address space are read in the same request when they
+ * sit in the following swap slots, which is the case for pages that were
+ * evicted together, and memory is not short. MADV_SEQUENTIAL pages read
+ * further ahead, down to the pageout low watermark, MADV_RANDOM ones
+ * don't read ahead. Returns the number of pages read, 0 with the frame
+ * freed if someone else is already reading the page.
+ */
+static unsigned swaponepageout(struct addrspace* as, struct page* pg,
+		paddr_t phyaddr) {
+	struct page* pages[SWAP_CLUSTER];
+	paddr_t frames[SWAP_CLUSTER];
+	int swapPageindex = pg->pt_pagebase;
+	unsigned n = 1;
+
+	if (!claimSwapped(pg, swapPageindex)) {
+		coremap_freeuserpages(phyaddr);
+		return 0;
+	}
+	unsigned window = SWAP_READAHEAD;
+	unsigned reserve = pageout_hiwater;
+	if (pg->pt_advice == MADV_SEQUENTIAL) {
+		window = SWAP_CLUSTER;
+		reserve = pageout_lowater;
+	} else if (pg->pt_advice == MADV_RANDOM) {
+		window = 1;
+	}
+	pages[0] = pg;
+	frames[0] = phyaddr;
+	while (n < window && coremap_pages_free > reserve) {
+		vaddr_t vaddr = (pg->pt_virtbase + n) * PAGE_SIZE;
+		if (vaddr >= USERSPACETOP) {
+			break;
+		}
+		struct page* next = pagetable_lookup(as->as_pagetable, vaddr);
+		if (next == NULL || next->pt_state != PT_STATE_SWAPPED
+				|| next->pt_pagebase != swapPageindex + n) {
+			break;
+		}
+		paddr_t frame = coremap_allocuserpages(1, as);
+		if (frame == 0) {
+			break;
+		}
+		if (!claimSwapped(next, swapPageindex + n)) {
+			coremap_freeuserpages(frame);
+			break;
+		}
+		pages[n] = next;
+		frames[n] = frame;
+		n++;
+	}
+
+	int result = swap_io(swapPageindex, frames, n, UIO_READ);
+	if (result) {
+		// release lock on the vnode
+		panic("READ FAILED!\n");
+		return 0;
+	}
+	VMSTAT_ADD(vs_readahead, n - 1);
+
+	bool keep = swapKeepCopies();
+	unsigned i;
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i < n; i++) {
+		unsigned idx = cm_getEntryIndex(frames[i]);
+		if (keep) {
+			// the page is clean, evicting it again needs no write
+			cm_setEntrySwapSlot(COREMAP(idx), swapPageindex + i);
+		} else {
+			freeOneSwapPage(swapPageindex + i);
+			// nothing backs the page now, it must be written out again
+			cm_setEntryDirtyState(COREMAP(idx), true);
+		}
+		//kprintf("Swap out:\tswap= %x,\tpage=%x \n",swapPageindex,pg->pt_virtbase);
+		pages[i]->pt_state = PT_STATE_MAPPED;
+		pages[i]->pt_pagebase = frames[i] / PAGE_SIZE;
+		// the frame is freshly allocated, so it is private to this address space
+		pages[i]->pt_cow = 0;
+		// pages read ahead are the first to go again if nobody touches them
+		pages[i]->pt_reference = 0;
+		cm_setEntryPte(COREMAP(idx), pages[i]);
+	}
+	wchan_wakeall(swap_transit_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+	return n;
+}
+
+/*
+ * Sort a cluster of victims by address space and virtual address, so
+ * neighbouring pages land in neighbouring swap slots and can be read back
+ * together.
+ */
+static void sortCluster(unsigned* victims, unsigned nvictims) {
+	unsigned i, j;
+	for (i = 1; i < nvictims; i++) {
+		unsigned v = victims[i];
+		struct addrspace* as = cm_getEntryAddrspaceIdent(COREMAP(v));
+		vaddr_t vpn = cm_getEntryPte(COREMAP(v))->pt_virtbase;
+		for (j = i; j > 0; j--) {
+			unsigned u = victims[j - 1];
+			struct addrspace* uas = cm_getEntryAddrspaceIdent(COREMAP(u));
+			if (uas < as || (uas == as
+					&& cm_getEntryPte(COREMAP(u))->pt_virtbase < vpn)) {
+				break;
+			}
+			victims[j] = u;
+		}
+		victims[j] = v;
+	}
+}
+
+/*
+ * Evict the pages in the given coremap frames and free the frames. Only
+ * dirty pages are written to swap. A clean page goes back to the swap
+ * copy it was read from, or is dropped if it never had one, as it then
+ * still matches what as_fill_page gives a new page. Called with swap_lock
+ * and coremap_lock held; coremap_lock is dropped while the disk is busy.
+ * The pages are marked in transit meanwhile, so the owner waits instead
+ * of writing to a frame that is being copied out.
+ */
+static void swapclusterin(unsigned* victims, unsigned nvictims) {
+	int slots[SWAP_CLUSTER];
+	paddr_t frames[SWAP_CLUSTER];
+	unsigned ndirty = 0;
+	struct tlb_batch tb;
+	unsigned i;
+
+	COMPILE_ASSERT(SWAP_CLUSTER <= TLBSHOOTDOWN_MAX);
+	KASSERT(nvictims > 0 && nvictims <= SWAP_CLUSTER);
+	tlb_batch_init(&tb);
+	sortCluster(victims, nvictims);
+	for (i = 0; i < nvictims; i++) {
+		struct page* pg = findPageFromCoreMap(COREMAP(victims[i]), victims[i]);
+		pg->pt_state = PT_STATE_INTRANSIT;
+		// nobody may find the frame and share it from now on
+		pcache_remove(victims[i]);
+		tlb_batch_add(&tb, cm_getEntryAddrspaceIdent(COREMAP(victims[i])),
+				pg->pt_virtbase * PAGE_SIZE);
+		// the dirty bit can't change now, writes wait for the transit
+		if (cm_isEntryDirty(COREMAP(victims[i]))) {
+			frames[ndirty++] = cm_getEntryPaddr(victims[i]);
+		}
+	}
+	VMSTAT_ADD(vs_evictions, nvictims);
+	VMSTAT_ADD(vs_cleanevictions, nvictims - ndirty);
+
+	// no cpu may write to the frames once they are being copied out
+	spinlock_release(&coremap_lock);
+	tlb_batch_sync(&tb);
+
+	// write the cluster in as few runs of consecutive slots as the disk allows
+	i = 0;
+	while (i < ndirty) {
+		unsigned got;
+		int swapPageindex = getSwapRun(ndirty - i, &got);
+		if (swapPageindex < 0) {
+			panic("Out of swap space!\n");
+		}
+		int result = swap_io(swapPageindex, &frames[i], got, UIO_WRITE);
+		if (result) {
+			// release lock on the vnode
+			panic("WRITE FAILED!\n");
+		}
+		unsigned j;
+		for (j = 0; j < got; j++) {
+			slots[i + j] = swapPageindex + j;
+		}
+		i += got;
+	}
+	spinlock_acquire(&coremap_lock);
+
+	unsigned written = 0;
+	for (i = 0; i < nvictims; i++) {
+		unsigned j = victims[i];
+		struct page* pg = cm_getEntryPte(COREMAP(j));
+		if (cm_isEntryDirty(COREMAP(j))) {
+			pg->pt_state = PT_STATE_SWAPPED;
+			pg->pt_pagebase = slots[written++];
+		} else if (cm_getEntrySwapSlot(COREMAP(j)) >= 0) {
+			// the copy on disk now belongs to the page
+			pg->pt_state = PT_STATE_SWAPPED;
+			pg->pt_pagebase = cm_getEntrySwapSlot(COREMAP(j));
+			cm_setEntrySwapSlot(COREMAP(j), -1);
+		} else {
+			pg->pt_state = PT_STATE_DROPPED;
+			pg->pt_pagebase = 0;
+		}
+		cm_setEntryUseState(COREMAP(j), false);
+		cm_setEntryDirtyState(COREMAP(j), false);
+		// let the address space identifier be NULL initially
+		cm_setEntryAddrspaceIdent(COREMAP(j), NULL);
+		cm_setEntryPte(COREMAP(j), NULL);
+		cm_setEntryRefcount(COREMAP(j), 0);
+		cm_buddyFreeBlock(j, 0);
+		coremap_pages_free++;
+	}
+	wchan_wakeall(swap_transit_wchan, &coremap_lock);
+}
+
+/*
+ * Can the frames [start, start + npages) be freed by writing their user
+ * pages to swap? Kernel frames and shared frames can't be moved, and pages
+ * of the faulting address space that are in the TLB are probably hot.
+ * Dirty pages of shared mappings must be written to their file first, and
+ * pages being written there are in transit.
+ */
+static bool canEvictFrame(unsigned i) {
+	return cm_getEntryAddrspaceIdent(COREMAP(i)) != NULL
+			&& cm_getEntryPte(COREMAP(i)) != NULL
+			&& cm_getEntryRefcount(COREMAP(i)) == 1
+			&& !cm_isEntryFileDirty(COREMAP(i))
+			&& cm_getEntryPte(COREMAP(i))->pt_state == PT_STATE_MAPPED;
+}
+
+static bool canEvictBlock(unsigned start, unsigned npages) {
+	unsigned i;
+	for (i = start; i < start + npages; i++) {
+		if (cm_isEntryUsed(COREMAP(i)) && !canEvictFrame(i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Second chance: report whether any page in the block was used since the
+ * hand last passed, and clear the reference bits. The TLB entry is dropped
+ * too, otherwise the next access would not fault and set the bit again.
+ * Only this cpu's entry is dropped, this runs under coremap_lock. A page
+ * used through another cpu's TLB just looks idle, and eviction shoots
+ * that entry down before the page is written out.
+ */
+static bool clockReferenced(unsigned start, unsigned npages) {
+	bool referenced = false;
+	unsigned i;
+	for (i = start; i < start + npages; i++) {
+		if (!cm_isEntryUsed(COREMAP(i))) {
+			continue;
+		}
+		struct page* pg = findPageFromCoreMap(COREMAP(i), i);
+		if (pg->pt_reference) {
+			referenced = true;
+			pg->pt_reference = 0;
+			tlb_invalidate(cm_getEntryAddrspaceIdent(COREMAP(i)),
+					pg->pt_virtbase * PAGE_SIZE);
+		}
+	}
+	return referenced;
+}
+
+/*
+ * Write user pages to swap until a buddy block big enough for npages is
+ * free. Returns false if there is nothing left that can be evicted.
+ * Victims are chosen with the clock algorithm: the hand sweeps aligned
+ * blocks, giving recently referenced ones a second chance. Small
+ * requests keep sweeping a little further to collect up to
+ * SWAP_CLUSTER victims, which are written out together.
+ */
+static bool swapin(int npages) {
+	// 1. check if coremap lock is already held, else acquire it
 
+	if (swap_state == SWAP_STATE_NOSWAP) {
+		panic("Attempting to swap in when no swap disk is found!\n");
+	}
+	lock_acquire(swap_lock);
+	spinlock_acquire(&coremap_lock);
+	// 2. select a bunch of non kernel pages, aligned so they coalesce
+	unsigned blocksize = 1U << cm_orderFor(npages);
+	unsigned nblocks = page_count / blocksize;
+	unsigned victims[SWAP_CLUSTER];
+	unsigned nvictims = 0;
+	bool found = false;
+	unsigned b, scanned = 0;
+
+	// the first sweep may do nothing but clear reference bits
+	for (b = 0; b < 2 * nblocks; b++) {
+		if (found && (blocksize > SWAP_CLUSTER - nvictims
+				|| ++scanned > SWAP_CLUSTER_SCAN)) {
+			break;
+		}
+		unsigned start = (clock_hand / blocksize % nblocks) * blocksize;
+		clock_hand = start + blocksize;
+		if (!canEvictBlock(start, blocksize)
+				|| clockReferenced(start, blocksize)) {
+			continue;
+		}
+		found = true;
+		unsigned j;
+		for (j = start; j < start + blocksize; j++) {
+			// recheck, the frames may have changed hands during a write
+			if (!cm_isEntryUsed(COREMAP(j)) || !canEvictFrame(j)) {
+				continue;
+			}
+			victims[nvictims++] = j;
+			if (nvictims == SWAP_CLUSTER) {
+				// a block bigger than a cluster goes out in several
+				swapclusterin(victims, nvictims);
+				nvictims = 0;
+			}
+		}
+	}
+	if (nvictims > 0) {
+		swapclusterin(victims, nvictims);
+	}
+	// if nothing was found everything left is kernel memory or shared
+	spinlock_release(&coremap_lock);
+	lock_release(swap_lock);
+	return found;
 }
 
-static void swapfree(struct page* pg) {
+static void swapout(struct addrspace*as, struct page* pg) {
 	if (swap_state == SWAP_STATE_NOSWAP) {
 		panic("Attempting to swap out when no swap disk is found!\n");
 	}
+	// 2. allocate a page in coremap for this
+	paddr_t phaddress = coremap_allocuserpages(1, as);
+	if (phaddress == 0) {
+		kprintf("no page to swap in to \n");
+		return;
+	}
+
+	// 3. copy content from disk to the new page
+	// 4. update page table entry
+	// 5. free the swap page
+	swaponepageout(as, pg, phaddress);
+
+}
+
+/* Give a dropped page a frame again, filled the way page_create does */
+static void refillPage(struct addrspace* as, struct page* pg) {
+	paddr_t frame = coremap_allocuserpages(1, as);
+	if (frame == 0) {
+		return;
+	}
+	if (as_fill_page(as, pg->pt_virtbase * PAGE_SIZE, frame)) {
+		coremap_freeuserpages(frame);
+		return;
+	}
+	pg->pt_pagebase = frame / PAGE_SIZE;
+	pg->pt_state = PT_STATE_MAPPED;
+	coremap_setpte(frame, pg);
+	VMSTAT_INC(vs_refills);
+}
+
+/*
+ * Map page pageno of the file v at pg, sharing the frame from the page
+ * cache, or reading it and adding it to the cache. A text page is
+ * copy-on-write, a write gives the process a private copy. A page of a
+ * shared mapping is mapped writable, so every process mapping the file
+ * sees the writes. Returns false if there was no frame to read it into.
+ */
+static bool filePageMap(struct addrspace* as, struct page* pg,
+		struct vnode* v, unsigned pageno, bool shared) {
+	spinlock_acquire(&coremap_lock);
+	int idx = pcache_lookup(v, pageno);
+	if (idx != CM_NONE) {
+		cm_setEntryRefcount(COREMAP(idx), cm_getEntryRefcount(COREMAP(idx)) + 1);
+	}
+	spinlock_release(&coremap_lock);
+
+	if (idx == CM_NONE) {
+		paddr_t frame = coremap_allocuserpages(1, as);
+		if (frame == 0) {
+			return false;
+		}
+		if (as_fill_page(as, pg->pt_virtbase * PAGE_SIZE, frame)) {
+			coremap_freeuserpages(frame);
+			return false;
+		}
+		if (!shared) {
+			VMSTAT_INC(vs_textmisses);
+		}
+		pg->pt_pagebase = frame / PAGE_SIZE;
+		pg->pt_state = PT_STATE_MAPPED;
+		pg->pt_cow = !shared;
+		spinlock_acquire(&coremap_lock);
+		idx = pcache_lookup(v, pageno);
+		if (idx == CM_NONE) {
+			pcache_insert(cm_getEntryIndex(frame), v, pageno);
+			// the only user may have it evicted, like any private frame
+			cm_setEntryPte(COREMAP(cm_getEntryIndex(frame)), pg);
+			spinlock_release(&coremap_lock);
+			return true;
+		}
+		// another process read it meanwhile, use theirs
+		cm_setEntryRefcount(COREMAP(idx), cm_getEntryRefcount(COREMAP(idx)) + 1);
+		spinlock_release(&coremap_lock);
+		coremap_freeuserpages(frame);
+	} else if (!shared) {
+		VMSTAT_INC(vs_textshared);
+	}
+
+	pg->pt_pagebase = cm_getEntryPaddr(idx) / PAGE_SIZE;
+	pg->pt_state = PT_STATE_MAPPED;
+	pg->pt_cow = !shared;
+	return true;
+}
+
+static struct page* filePageCreate(struct addrspace* as, vaddr_t vaddr,
+		struct vnode* v, unsigned pageno, bool shared) {
+	struct page* pg = pagetable_insert(as->as_pagetable, vaddr & PAGE_FRAME);
+	if (pg == NULL) {
+		return NULL;
+	}
+	if (!filePageMap(as, pg, v, pageno, shared)) {
+		pagetable_remove(as->as_pagetable, vaddr & PAGE_FRAME);
+		return NULL;
+	}
+	return pg;
+}
+
+/*
+ * Load a translation into the TLB, replacing the entry for the same virtual
+ * page if there is one. The TLB must never hold two entries for one page.
+ */
+static void tlb_load(struct addrspace* as, vaddr_t vaddr, uint32_t entrylo) {
+	KASSERT(as->as_asid == curcpu->c_asid);
+	uint32_t entryhi = TLBHI_ASID(vaddr, as->as_asid);
+	int spl = splhigh();
+	int tlbpos = tlb_probe(entryhi, 0);
+	if (tlbpos >= 0) {
+		tlb_write(entryhi, entrylo, tlbpos);
+	} else {
+		tlb_random(entryhi, entrylo);
+	}
+	splx(spl);
+}
+
+/*
+ * Give the page a private frame before it is written. If nobody else
+ * shares the frame any more it is simply taken over.
+ */
+static int breakCopyOnWrite(struct addrspace* as, struct page* pg) {
+	spinlock_acquire(&coremap_lock);
+	if (pg->pt_state != PT_STATE_MAPPED) {
+		// the frame was evicted since the caller looked, pt_pagebase is a
+		// swap slot now and the retried access faults the page back in
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	paddr_t oldaddr = pg->pt_pagebase * PAGE_SIZE;
+	unsigned idx = cm_getEntryIndex(oldaddr);
+	if (cm_getEntryRefcount(COREMAP(idx)) == 1) {
+		// the frame won't hold the file contents much longer
+		pcache_remove(idx);
+		cm_setEntryAddrspaceIdent(COREMAP(idx), as);
+		cm_setEntryPte(COREMAP(idx), pg);
+		// under the lock, page merging looks at pt_cow of private frames
+		pg->pt_cow = 0;
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	spinlock_release(&coremap_lock);
+
+	paddr_t newaddr = coremap_allocuserpages(1, as);
+	if (newaddr == 0) {
+		return ENOMEM;
+	}
+	memmove(PADDR_TO_KVADDR((void*) newaddr),
+			PADDR_TO_KVADDR((void*) oldaddr), PAGE_SIZE);
+	VMSTAT_INC(vs_cowcopies);
+	pg->pt_pagebase = newaddr / PAGE_SIZE;
+	pg->pt_cow = 0;
+	coremap_setpte(newaddr, pg);
+	// other cpus we ran on may still map the shared frame
+	struct tlb_batch tb;
+	tlb_batch_init(&tb);
+	tlb_batch_add(&tb, as, pg->pt_virtbase * PAGE_SIZE);
+	tlb_batch_sync(&tb);
+	// drop our reference on the shared frame
+	coremap_freeuserpages(oldaddr);
+	return 0;
+}
+
+/* How often sharedPageCopy tries to bring a page in before giving up */
+#define SHARE_TRIES 3
+
+/*
+ * Share the frame of a page of a MAP_SHARED mapping writable with newpg.
+ * A dropped page is left to be filled again through the page cache by
+ * whichever side touches it first. A swapped page, which only a page past
+ * the end of the file can be, is brought in for oldas first. Returns
+ * false if there was no frame for it.
+ */
+static bool sharedPageCopy(struct addrspace* oldas, struct page* pg,
+		struct page* newpg) {
+	unsigned tries = 0;
+
+	// a frame merged with someone else's must not become writable
+	if (pg->pt_state == PT_STATE_MAPPED && pg->pt_cow
+			&& breakCopyOnWrite(oldas, pg)) {
+		return false;
+	}
+	spinlock_acquire(&coremap_lock);
+	while (true) {
+		while (pg->pt_state == PT_STATE_INTRANSIT) {
+			wchan_sleep(swap_transit_wchan, &coremap_lock);
+		}
+		if (pg->pt_state == PT_STATE_DROPPED) {
+			spinlock_release(&coremap_lock);
+			newpg->pt_state = PT_STATE_DROPPED;
+			newpg->pt_permission = pg->pt_permission;
+			return true;
+		}
+		if (pg->pt_state == PT_STATE_MAPPED && !pg->pt_cow) {
+			break;
+		}
+		if (tries++ == SHARE_TRIES) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		spinlock_release(&coremap_lock);
+		if (pg->pt_state == PT_STATE_SWAPPED) {
+			swapout(oldas, pg);
+		} else if (pg->pt_cow && breakCopyOnWrite(oldas, pg)) {
+			return false;
+		}
+		spinlock_acquire(&coremap_lock);
+	}
+	// the frame can't be evicted from now on, and both sides may write it
+	unsigned idx = cm_getEntryIndex(pg->pt_pagebase * PAGE_SIZE);
+	cm_setEntryRefcount(COREMAP(idx), cm_getEntryRefcount(COREMAP(idx)) + 1);
+	spinlock_release(&coremap_lock);
+
+	newpg->pt_pagebase = pg->pt_pagebase;
+	newpg->pt_state = PT_STATE_MAPPED;
+	newpg->pt_permission = pg->pt_permission;
+	newpg->pt_cow = 0;
+	return true;
+}
+
+int page_copy(struct addrspace* oldas, struct addrspace* newas,
+		struct page* pg, bool shared) {
+	vaddr_t vaddr = pg->pt_virtbase * PAGE_SIZE;
+
+	struct page* newpg = pagetable_insert(newas->as_pagetable, vaddr);
+	if (newpg == NULL) {
+		return ENOMEM;
+	}
+	if (shared) {
+		if (!sharedPageCopy(oldas, pg, newpg)) {
+			pagetable_remove(newas->as_pagetable, vaddr);
+			return ENOMEM;
+		}
+		return 0;
+	}
+	// the pageout thread may be evicting the page, so look at it under the lock
+	spinlock_acquire(&coremap_lock);
+	while (pg->pt_state == PT_STATE_INTRANSIT) {
+		wchan_sleep(swap_transit_wchan, &coremap_lock);
+	}
+	if (pg->pt_state == PT_STATE_MAPPED) {
+		unsigned idx = cm_getEntryIndex(pg->pt_pagebase * PAGE_SIZE);
+		// a shared frame is never chosen for eviction
+		cm_setEntryRefcount(COREMAP(idx), cm_getEntryRefcount(COREMAP(idx)) + 1);
+		pg->pt_cow = 1;
+		spinlock_release(&coremap_lock);
+
+		newpg->pt_pagebase = pg->pt_pagebase;
+		newpg->pt_state = PT_STATE_MAPPED;
+		newpg->pt_permission = pg->pt_permission;
+		newpg->pt_cow = 1;
+		return 0;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (pg->pt_state == PT_STATE_DROPPED) {
+		// the child refills it from the same regions
+		newpg->pt_state = PT_STATE_DROPPED;
+		newpg->pt_permission = pg->pt_permission;
+		return 0;
+	}
+
+	// pages on disk are not shared, read a private copy for the child
+	paddr_t frame = coremap_allocuserpages(1, newas);
+	if (frame == 0) {
+		pagetable_remove(newas->as_pagetable, vaddr);
+		return ENOMEM;
+	}
+	int slot = pg->pt_pagebase;
+	if (!claimSwapped(pg, slot)) {
+		// the prefetcher read it back meanwhile, share the frame after all
+		coremap_freeuserpages(frame);
+		pagetable_remove(newas->as_pagetable, vaddr);
+		return page_copy(oldas, newas, pg, false);
+	}
 	lock_acquire(swap_lock);
-	swap_map[pg->pt_pagebase].se_used = SWAP_PAGE_FREE;
-	// 1. check if coremap lock is already held, else acquire it
-	// 2. free the swap page. // TODO create a common method for freeing pages
-	// 3. release lock if you had acquired it in this method
+	int result = swap_io(slot, &frame, 1, UIO_READ);
 	lock_release(swap_lock);
+	if (result) {
+		panic("READ FAILED!\n");
+	}
+	spinlock_acquire(&coremap_lock);
+	pg->pt_state = PT_STATE_SWAPPED;
+	wchan_wakeall(swap_transit_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+	// the slot stays the parent's, so the child's copy has no backing
+	cm_setEntryDirtyState(COREMAP(cm_getEntryIndex(frame)), true);
+	// the frame can only be evicted once it is filled and has its pte
+	newpg->pt_pagebase = frame / PAGE_SIZE;
+	newpg->pt_state = PT_STATE_MAPPED;
+	newpg->pt_permission = pg->pt_permission;
+	coremap_setpte(frame, newpg);
+	return 0;
+}
+
+/* Fault handling function called by trap code */
+int vm_fault(int faulttype, vaddr_t faultaddress) {
+	struct addrspace* as = proc_getas();
+	if (as == NULL) {
+		//kprintf("AS was null\n");
+		return EFAULT;
+	}
+	struct region* reg = findRegionForFaultAddress(as, faultaddress);
+	if (reg == NULL) {
+		//kprintf("Region not found\n");
+		return EFAULT;
+	}
+	// TODO Check if it is a permission issue and return an error code in that case.
+	bool write = faulttype != VM_FAULT_READ;
+	if (reg->mmapped && !(write ? reg->writeable : reg->readable || reg->executable)) {
+		// mmap() protections are enforced, the loader's aren't yet
+		return EFAULT;
+	}
+
+	VMSTAT_INC(vs_faults);
+	if (as->as_suspended) {
+		loadctlWait(as);
+	}
+
+	// get page
+	struct page* pg = findPageForFaultAddress(as, faultaddress);
+	// the time it takes to bring a page in is what tells thrashing apart
+	bool resident = pg != NULL && pg->pt_state == PT_STATE_MAPPED;
+	struct timespec slowstart;
+	if (!resident) {
+		gettime(&slowstart);
+	}
+	// text and shared mapping pages are found through the page cache
+	struct vnode* filevnode;
+	unsigned filepage;
+	bool shared = as_shared_page(as, faultaddress, &filevnode, &filepage);
+	bool cached = shared
+			|| as_text_page(as, faultaddress, &filevnode, &filepage);
+	if (pg == NULL && cached) {
+		pg = filePageCreate(as, faultaddress, filevnode, filepage, shared);
+	} else if (pg == NULL) {
+		pg = page_create(as, faultaddress);
+		VMSTAT_INC(vs_zerofills);
+	}
+	if (pg == NULL) {
+		//kprintf("Failed to create a page\n");
+		return EFAULT;
+	}
+	waitForTransit(pg);
+	if (pg->pt_state == PT_STATE_SWAPPED) {
+		//kprintf("Trying swap out from %x\n",pg->pt_pagebase);
+		//kprintf("Swap out page Vaddr = %x\n",pg->pt_virtbase);
+		swapout(as, pg);
+		VMSTAT_INC(vs_majorfaults);
+		// the prefetcher may have been reading it in meanwhile
+		waitForTransit(pg);
+		//kprintf("after swap out paddr = %x\n",pg->pt_pagebase);
+		//kprintf("after Swap out Vaddr = %x\n", pg->pt_virtbase);
+		//kprintf("after Swap out state = %d\n",pg->pt_state);
+	}
+	if (pg->pt_state == PT_STATE_DROPPED) {
+		if (cached) {
+			filePageMap(as, pg, filevnode, filepage, shared);
+		} else {
+			refillPage(as, pg);
+		}
+	}
+	if (!resident) {
+		loadctlAccount(&slowstart);
+	}
+	if (pg->pt_state != PT_STATE_MAPPED) {
+		// could not get a frame to bring the page back
+		return ENOMEM;
+	}
+
+	if (pg->pt_cow && write) {
+		int result = breakCopyOnWrite(as, pg);
+		if (result) {
+			return result;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (pg->pt_state != PT_STATE_MAPPED) {
+		// evicted again already, the retried access will fault once more
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	unsigned idx = cm_getEntryIndex(pg->pt_pagebase * PAGE_SIZE);
+	if (!pg->pt_cow && cm_getEntryPte(COREMAP(idx)) == NULL
+			&& cm_getEntryRefcount(COREMAP(idx)) == 1) {
+		// a shared mapping's frame whose other sharer let go, it is
+		// ours now and may be evicted again
+		cm_setEntryAddrspaceIdent(COREMAP(idx), as);
+		cm_setEntryPte(COREMAP(idx), pg);
+	}
+	if (write) {
+		// the copy on swap, if any, is stale from now on
+		cm_setEntryDirtyState(COREMAP(idx), true);
+		cm_dropSwapCopy(idx);
+		if (reg->shared) {
+			pg->pt_dirty = 1;
+		}
+	}
+	// shared frames are mapped read only until the first write, and so are
+	// clean frames and clean pages of shared mappings, so that the
+	// VM_FAULT_READONLY trap tells us about the write
+	uint32_t entrylo = (pg->pt_pagebase * PAGE_SIZE) | TLBLO_VALID;
+	if (!pg->pt_cow && cm_isEntryDirty(COREMAP(idx))
+			&& (!reg->mmapped || reg->writeable)
+			&& (!reg->shared || pg->pt_dirty)) {
+		entrylo |= TLBLO_DIRTY;
+	}
+	// the clock hand clears this, and drops the TLB entry so we see the next use
+	pg->pt_reference = 1;
+	tlb_load(as, pg->pt_virtbase * PAGE_SIZE, entrylo);
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * A dirty page of a shared file mapping can't go to swap: a process that
+ * maps the file later finds the page in the page cache or reads it from
+ * the file, and would miss the writes. The pageout thread writes idle
+ * ones back to their file instead, after which they are clean and are
+ * dropped like any other clean page. Only the pageout thread does this,
+ * a faulting thread may hold locks of the file system it writes to.
+ */
+#define CLEAN_SCAN 64 // frames looked at per call while others are evictable
+
+// where the next cleaning pass starts, protected by coremap_lock
+static unsigned clean_hand = 0;
+
+/* Write a cached page of a shared mapping to its file, up to the end of it */
+static int writeCachedPage(struct vnode* v, unsigned pageno, paddr_t frame) {
+	struct stat st;
+	int result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	off_t offset = (off_t) pageno * PAGE_SIZE;
+	if (st.st_size <= offset) {
+		// the file was truncated, the page is no longer part of it
+		return 0;
+	}
+	size_t len = st.st_size - offset < PAGE_SIZE ?
+			(size_t) (st.st_size - offset) : PAGE_SIZE;
+	struct iovec iov;
+	struct uio ku;
+	uio_kinit(&iov, &ku, (void*) PADDR_TO_KVADDR(frame), len, offset,
+			UIO_WRITE);
+	// not under vn_opslock, read() holds it while it faults on the buffer
+	return VOP_WRITE(v, &ku);
+}
+
+/*
+ * Write back up to SWAP_CLUSTER idle dirty frames of shared file
+ * mappings, looking at no more than scan frames. Frames used since the
+ * last pass get a second chance, like in swapin. The pages are in
+ * transit while they are written, so that their owner waits instead of
+ * writing to them unseen. Returns false if nothing was written.
+ */
+static bool cleanSharedPages(unsigned scan) {
+	unsigned victims[SWAP_CLUSTER];
+	struct vnode* vnodes[SWAP_CLUSTER];
+	unsigned pagenos[SWAP_CLUSTER];
+	struct page* pages[SWAP_CLUSTER];
+	unsigned n = 0;
+	struct tlb_batch tb;
+	unsigned i;
+
+	tlb_batch_init(&tb);
+	spinlock_acquire(&coremap_lock);
+	while (scan-- > 0 && n < SWAP_CLUSTER) {
+		unsigned j = clean_hand;
+		clean_hand = (clean_hand + 1) % page_count;
+		struct addrspace* as = cm_getEntryAddrspaceIdent(COREMAP(j));
+		struct page* pg = cm_getEntryPte(COREMAP(j));
+		if (!cm_isEntryUsed(COREMAP(j)) || !cm_isEntryFileDirty(COREMAP(j))
+				|| as == NULL || pg == NULL
+				|| cm_getEntryRefcount(COREMAP(j)) != 1
+				|| pg->pt_state != PT_STATE_MAPPED) {
+			continue;
+		}
+		if (pg->pt_reference) {
+			pg->pt_reference = 0;
+			tlb_invalidate(as, pg->pt_virtbase * PAGE_SIZE);
+			continue;
+		}
+		pg->pt_state = PT_STATE_INTRANSIT;
+		// a write from now on dirties the page again
+		cm_setEntryDirtyState(COREMAP(j), false);
+		pg->pt_dirty = 0;
+		tlb_batch_add(&tb, as, pg->pt_virtbase * PAGE_SIZE);
+		victims[n] = j;
+		// the owner can't unmap it meanwhile, so its region keeps the vnode
+		vnodes[n] = COREMAP(j)->pc_vnode;
+		pagenos[n] = COREMAP(j)->pc_pageno;
+		pages[n] = pg;
+		n++;
+	}
+	spinlock_release(&coremap_lock);
+	if (n == 0) {
+		return false;
+	}
+	// no cpu may write to the frames without faulting from now on
+	tlb_batch_sync(&tb);
+
+	for (i = 0; i < n; i++) {
+		int result = writeCachedPage(vnodes[i], pagenos[i],
+				cm_getEntryPaddr(victims[i]));
+		spinlock_acquire(&coremap_lock);
+		if (result) {
+			// keep it, and try again on a later pass
+			cm_setEntryDirtyState(COREMAP(victims[i]), true);
+			pages[i]->pt_dirty = 1;
+		}
+		pages[i]->pt_state = PT_STATE_MAPPED;
+		wchan_wakeall(swap_transit_wchan, &coremap_lock);
+		spinlock_release(&coremap_lock);
+	}
+	VMSTAT_ADD(vs_cleaned, n);
+	return true;
+}
+
+/*
+ * Pageout thread. It sleeps until an allocation leaves fewer than
+ * pageout_lowater free frames, then evicts pages until pageout_hiwater
+ * frames are free, so that faults rarely have to wait for a disk write.
+ */
+static void pageout_thread(void* data1, unsigned long data2) {
+	(void) data1;
+	(void) data2;
+	bool stuck = false;
+
+	while (true) {
+		spinlock_acquire(&coremap_lock);
+		while (stuck || coremap_pages_free >= pageout_lowater) {
+			wchan_sleep(pageout_wchan, &coremap_lock);
+			stuck = false;
+		}
+		spinlock_release(&coremap_lock);
+
+		while (coremap_pages_free < pageout_hiwater) {
+			// written back now, the pages can be dropped on a later pass
+			bool cleaned = cleanSharedPages(CLEAN_SCAN);
+			if (!swapin(1) && !cleaned && !cleanSharedPages(page_count)) {
+				// nothing evictable, wait for the next allocation
+				stuck = true;
+				break;
+			}
+		}
+	}
+}
+
+static void pageout_start(void) {
+	pageout_lowater = page_count / PAGEOUT_LOWATER_DIV + 4;
+	pageout_hiwater = page_count / PAGEOUT_HIWATER_DIV + 8;
+	struct wchan* wc = wchan_create("pageout");
+	if (wc == NULL) {
+		kprintf("WARN no pageout thread, evicting on demand only\n");
+		return;
+	}
+	if (thread_fork("pageout", NULL, pageout_thread, NULL, 0)) {
+		kprintf("WARN no pageout thread, evicting on demand only\n");
+		wchan_destroy(wc);
+		return;
+	}
+	spinlock_acquire(&coremap_lock);
+	pageout_wchan = wc;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Same-page merging. A scanner thread walks the coremap looking at private
+ * user frames. A frame whose checksum didn't change since the last pass
+ * is write protected and looked up by checksum in the page cache. If an
+ * identical frame is there the page is moved to it, shared copy-on-write
+ * as after a fork, and its own frame is freed. Otherwise the frame goes
+ * in the cache for the next identical page to find. A write to a merged
+ * page breaks the sharing like for any copy-on-write page.
+ */
+#define PAGEMERGE_BATCH 256 // frames looked at per second
+
+static uint32_t pageChecksum(paddr_t frame) {
+	const uint32_t* words = (const uint32_t*) PADDR_TO_KVADDR(frame);
+	uint32_t sum = 2166136261U;
+	unsigned i;
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		sum = (sum ^ words[i]) * 16777619U;
+	}
+	return sum;
+}
+
+static bool pageEqual(paddr_t a, paddr_t b) {
+	const uint32_t* wa = (const uint32_t*) PADDR_TO_KVADDR(a);
+	const uint32_t* wb = (const uint32_t*) PADDR_TO_KVADDR(b);
+	unsigned i;
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (wa[i] != wb[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Does pg of as still own the private frame? Called with coremap_lock held */
+static bool canMergeFrame(unsigned idx, struct addrspace* as,
+		struct page* pg) {
+	return cm_isEntryUsed(COREMAP(idx))
+			&& cm_getEntryAddrspaceIdent(COREMAP(idx)) == as
+			&& cm_getEntryPte(COREMAP(idx)) == pg
+			&& cm_getEntryRefcount(COREMAP(idx)) == 1
+			&& !cm_isEntryCached(COREMAP(idx))
+			&& pg->pt_state == PT_STATE_MAPPED
+			&& pg->pt_pagebase == cm_getEntryPaddr(idx) / PAGE_SIZE;
+}
+
+static void mergeFrame(unsigned idx) {
+	paddr_t frame = cm_getEntryPaddr(idx);
+	struct tlb_batch tb;
+
+	spinlock_acquire(&coremap_lock);
+	struct addrspace* as = cm_getEntryAddrspaceIdent(COREMAP(idx));
+	struct page* pg = cm_getEntryPte(COREMAP(idx));
+	bool candidate = as != NULL && pg != NULL && canMergeFrame(idx, as, pg)
+			&& !pg->pt_cow;
+	spinlock_release(&coremap_lock);
+	if (!candidate) {
+		return;
+	}
+
+	// pages that are still being written aren't worth write protecting
+	uint32_t sum = pageChecksum(frame);
+	if (sum != COREMAP(idx)->merge_sum) {
+		COREMAP(idx)->merge_sum = sum;
+		return;
+	}
+
+	// the contents can't change from here on, unless a write fault takes
+	// the frame back, which clears pt_cow
+	spinlock_acquire(&coremap_lock);
+	if (!canMergeFrame(idx, as, pg) || pg->pt_cow) {
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	pg->pt_cow = 1;
+	tlb_batch_init(&tb);
+	tlb_batch_add(&tb, as, pg->pt_virtbase * PAGE_SIZE);
+	spinlock_release(&coremap_lock);
+	tlb_batch_sync(&tb);
+
+	sum = pageChecksum(frame);
+
+	spinlock_acquire(&coremap_lock);
+	if (!canMergeFrame(idx, as, pg) || !pg->pt_cow) {
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	int other = pcache_lookup(NULL, sum);
+	if (other == CM_NONE) {
+		// the first of its kind, it stays write protected while cached
+		pcache_insert(idx, NULL, sum);
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	paddr_t otherframe = cm_getEntryPaddr(other);
+	if (!pageEqual(frame, otherframe)) {
+		// the checksums collide, the page stays private
+		pg->pt_cow = 0;
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	cm_setEntryRefcount(COREMAP(other),
+			cm_getEntryRefcount(COREMAP(other)) + 1);
+	pg->pt_pagebase = otherframe / PAGE_SIZE;
+	// detached, so the pageout thread leaves it alone until it is freed
+	cm_setEntryPte(COREMAP(idx), NULL);
+	// a read may have loaded the old frame into a TLB meanwhile
+	tlb_batch_add(&tb, as, pg->pt_virtbase * PAGE_SIZE);
+	spinlock_release(&coremap_lock);
+	tlb_batch_sync(&tb);
+	coremap_freeuserpages(frame);
+	VMSTAT_INC(vs_merged);
+}
+
+static void pagemerge_thread(void* data1, unsigned long data2) {
+	(void) data1;
+	(void) data2;
+	unsigned hand = 0;
+
+	while (true) {
+		unsigned n;
+		for (n = 0; n < PAGEMERGE_BATCH; n++) {
+			mergeFrame(hand);
+			hand = (hand + 1) % page_count;
+		}
+		clocksleep(1);
+	}
+}
+
+static void pagemerge_start(void) {
+	if (thread_fork("pagemerge", NULL, pagemerge_thread, NULL, 0)) {
+		kprintf("WARN no page merging thread\n");
+	}
+}
+
+/*
+ * Load control. When faults spend more than LOADCTL_THRASH_PCT of the
+ * cpus' time bringing pages in, evicting single pages only makes every
+ * process wait for every other one. The process with the largest
+ * resident set is then suspended instead: its faults wait until it is
+ * resumed, and all its pages are written out at once, so the rest get
+ * its memory. Suspended processes are resumed oldest first, one per
+ * interval, once memory has stopped being short and their resident set
+ * would fit, or after LOADCTL_MAXTIME intervals whatever the load, as
+ * they may hold locks the others are waiting for.
+ */
+#define LOADCTL_INTERVAL 1 // seconds
+#define LOADCTL_THRASH_PCT 50
+#define LOADCTL_MAXTIME 10
+#define LOADCTL_MAXSUSPEND 16
+// address spaces counted when looking for the largest resident set
+#define LOADCTL_TALLY 32
+
+struct loadctl_entry {
+	struct addrspace* ls_as;
+	unsigned ls_resident; // frames it had when suspended
+	unsigned ls_since;    // interval it was suspended in
+};
+
+// suspended address spaces, oldest first, protected by coremap_lock
+static struct loadctl_entry loadctl_suspended[LOADCTL_MAXSUSPEND];
+static unsigned loadctl_count = 0;
+static unsigned loadctl_intervals = 0;
+
+// faulting threads of suspended address spaces sleep here, protected by coremap_lock
+static struct wchan* loadctl_wchan = NULL;
+
+static void loadctlWait(struct addrspace* as) {
+	spinlock_acquire(&coremap_lock);
+	while (as->as_suspended) {
+		wchan_sleep(loadctl_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+static void loadctlAccount(const struct timespec* start) {
+	struct timespec now, spent;
+	gettime(&now);
+	timespec_sub(&now, start, &spent);
+	VMSTAT_ADD(vs_faultwait, spent.tv_sec * 1000000 + spent.tv_nsec / 1000);
+}
+
+/* Called with coremap_lock held */
+static int loadctlFind(struct addrspace* as) {
+	unsigned i;
+	for (i = 0; i < loadctl_count; i++) {
+		if (loadctl_suspended[i].ls_as == as) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Called with coremap_lock held */
+static void loadctlRemove(unsigned i) {
+	loadctl_suspended[i].ls_as->as_suspended = false;
+	for (; i + 1 < loadctl_count; i++) {
+		loadctl_suspended[i] = loadctl_suspended[i + 1];
+	}
+	loadctl_count--;
+	wchan_wakeall(loadctl_wchan, &coremap_lock);
+}
+
+void vm_resume(struct addrspace* as) {
+	// under the lock, load control may be picking it right now
+	spinlock_acquire(&coremap_lock);
+	int i = loadctlFind(as);
+	if (i >= 0) {
+		loadctlRemove(i);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * The running address space with the most frames, provided some other
+ * running one has frames too, as suspending the only one gains nothing.
+ * Called with coremap_lock held.
+ */
+static struct addrspace* loadctlVictim(unsigned* resident) {
+	struct addrspace* tally[LOADCTL_TALLY];
+	unsigned counts[LOADCTL_TALLY];
+	unsigned ntally = 0;
+	unsigned i, j;
+
+	for (i = 0; i < page_count; i++) {
+		struct addrspace* as = cm_getEntryAddrspaceIdent(COREMAP(i));
+		if (!cm_isEntryUsed(COREMAP(i)) || as == NULL || as->as_suspended) {
+			continue;
+		}
+		for (j = 0; j < ntally && tally[j] != as; j++) {
+		}
+		if (j == ntally) {
+			if (ntally == LOADCTL_TALLY) {
+				continue;
+			}
+			tally[ntally] = as;
+			counts[ntally++] = 0;
+		}
+		counts[j]++;
+	}
+	if (ntally < 2) {
+		return NULL;
+	}
+	unsigned best = 0;
+	for (j = 1; j < ntally; j++) {
+		if (counts[j] > counts[best]) {
+			best = j;
+		}
+	}
+	*resident = counts[best];
+	return tally[best];
+}
+
+/* Suspend the largest process and write all its pages out */
+static void loadctlSuspend(void) {
+	unsigned victims[SWAP_CLUSTER];
+	unsigned nvictims = 0;
+	unsigned resident;
+	unsigned i;
+
+	lock_acquire(swap_lock);
+	spinlock_acquire(&coremap_lock);
+	struct addrspace* as = loadctl_count < LOADCTL_MAXSUSPEND ?
+			loadctlVictim(&resident) : NULL;
+	if (as == NULL) {
+		spinlock_release(&coremap_lock);
+		lock_release(swap_lock);
+		return;
+	}
+	as->as_suspended = true;
+	loadctl_suspended[loadctl_count].ls_as = as;
+	loadctl_suspended[loadctl_count].ls_resident = resident;
+	loadctl_suspended[loadctl_count].ls_since = loadctl_intervals;
+	loadctl_count++;
+	VMSTAT_INC(vs_suspends);
+
+	for (i = 0; i < page_count; i++) {
+		// swapclusterin drops the lock, the process may be gone since
+		if (loadctlFind(as) < 0) {
+			nvictims = 0;
+			break;
+		}
+		if (cm_isEntryUsed(COREMAP(i))
+				&& cm_getEntryAddrspaceIdent(COREMAP(i)) == as
+				&& canEvictFrame(i)) {
+			victims[nvictims++] = i;
+			if (nvictims == SWAP_CLUSTER) {
+				swapclusterin(victims, nvictims);
+				nvictims = 0;
+			}
+		}
+	}
+	if (nvictims > 0) {
+		swapclusterin(victims, nvictims);
+	}
+	spinlock_release(&coremap_lock);
+	lock_release(swap_lock);
+}
+
+/* Resume the oldest suspended process if it fits, or has waited long enough */
+static void loadctlResume(bool thrashing) {
+	spinlock_acquire(&coremap_lock);
+	if (loadctl_count > 0) {
+		struct loadctl_entry* ls = &loadctl_suspended[0];
+		bool fits = !thrashing
+				&& coremap_pages_free > ls->ls_resident + pageout_hiwater;
+		if (fits || loadctl_intervals - ls->ls_since >= LOADCTL_MAXTIME) {
+			loadctlRemove(0);
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+static void loadctl_thread(void* data1, unsigned long data2) {
+	(void) data1;
+	(void) data2;
+	unsigned lastwait = 0;
+
+	while (true) {
+		clocksleep(LOADCTL_INTERVAL);
+		loadctl_intervals++;
+
+		spinlock_acquire(&vmstats_lock);
+		unsigned waited = vmstats.vs_faultwait - lastwait;
+		lastwait = vmstats.vs_faultwait;
+		spinlock_release(&vmstats_lock);
+
+		bool thrashing = waited / num_cpus
+				> LOADCTL_INTERVAL * 1000000 / 100 * LOADCTL_THRASH_PCT;
+		loadctlResume(thrashing);
+		if (thrashing) {
+			loadctlSuspend();
+		}
+	}
+}
+
+static void loadctl_start(void) {
+	struct wchan* wc = wchan_create("loadctl");
+	if (wc == NULL) {
+		kprintf("WARN no load control\n");
+		return;
+	}
+	loadctl_wchan = wc;
+	if (thread_fork("loadctl", NULL, loadctl_thread, NULL, 0)) {
+		kprintf("WARN no load control\n");
+	}
+}
+
+/*
+ * Reaper thread. Address spaces destroyed by exiting processes are freed
+ * here, so that exit and waitpid don't wait for that however big the
+ * process was.
+ */
+static struct spinlock reaper_lock = SPINLOCK_INITIALIZER;
+static struct wchan* reaper_wchan = NULL;
+static struct addrspace* reaper_queue = NULL;
+
+static void reaper_thread(void* data1, unsigned long data2) {
+	(void) data1;
+	(void) data2;
+
+	while (true) {
+		spinlock_acquire(&reaper_lock);
+		while (reaper_queue == NULL) {
+			wchan_sleep(reaper_wchan, &reaper_lock);
+		}
+		struct addrspace* as = reaper_queue;
+		reaper_queue = NULL;
+		spinlock_release(&reaper_lock);
+
+		while (as != NULL) {
+			struct addrspace* next = as->as_reapnext;
+			as_reclaim(as);
+			as = next;
+		}
+	}
+}
+
+static void reaper_start(void) {
+	struct wchan* wc = wchan_create("reaper");
+	if (wc == NULL) {
+		kprintf("WARN no reaper thread, exit frees memory itself\n");
+		return;
+	}
+	if (thread_fork("reaper", NULL, reaper_thread, NULL, 0)) {
+		kprintf("WARN no reaper thread, exit frees memory itself\n");
+		wchan_destroy(wc);
+		return;
+	}
+	spinlock_acquire(&reaper_lock);
+	reaper_wchan = wc;
+	spinlock_release(&reaper_lock);
+}
+
+void vm_reap(struct addrspace* as) {
+	spinlock_acquire(&reaper_lock);
+	if (reaper_wchan == NULL) {
+		spinlock_release(&reaper_lock);
+		as_reclaim(as);
+		return;
+	}
+	as->as_reapnext = reaper_queue;
+	reaper_queue = as;
+	wchan_wakeone(reaper_wchan, &reaper_lock);
+	spinlock_release(&reaper_lock);
+}
+
+/*
+ * Prefetch thread. MADV_WILLNEED queues a range, and this thread reads
+ * its swapped pages back while the process goes on running. It gives up
+ * on a range once free memory is down to the pageout high watermark, a
+ * prefetch must not make the pageout thread evict.
+ */
+struct prefetch_req {
+	struct addrspace* pr_as;
+	vaddr_t pr_start;
+	vaddr_t pr_end;
+	struct prefetch_req* pr_next;
+};
+
+static struct spinlock prefetch_lock = SPINLOCK_INITIALIZER;
+// the thread waits for requests on prefetch_wchan, cancels wait for the
+// thread on prefetch_donewchan, both protected by prefetch_lock
+static struct wchan* prefetch_wchan = NULL;
+static struct wchan* prefetch_donewchan = NULL;
+static struct prefetch_req* prefetch_queue = NULL;
+// the range being prefetched, and whether it is being unmapped
+static struct prefetch_req* prefetch_current = NULL;
+static bool prefetch_stop = false;
+
+static void prefetch_thread(void* data1, unsigned long data2) {
+	(void) data1;
+	(void) data2;
+
+	while (true) {
+		spinlock_acquire(&prefetch_lock);
+		while (prefetch_queue == NULL) {
+			wchan_sleep(prefetch_wchan, &prefetch_lock);
+		}
+		struct prefetch_req* req = prefetch_queue;
+		prefetch_queue = req->pr_next;
+		prefetch_current = req;
+		prefetch_stop = false;
+		spinlock_release(&prefetch_lock);
+
+		struct addrspace* as = req->pr_as;
+		vaddr_t vaddr;
+		for (vaddr = req->pr_start; vaddr < req->pr_end; vaddr += PAGE_SIZE) {
+			if (prefetch_stop || coremap_pages_free <= pageout_hiwater) {
+				break;
+			}
+			// swaponepageout rechecks this under the lock
+			struct page* pg = pagetable_lookup(as->as_pagetable, vaddr);
+			if (pg == NULL || pg->pt_state != PT_STATE_SWAPPED) {
+				continue;
+			}
+			paddr_t frame = coremap_allocuserpages(1, as);
+			if (frame == 0) {
+				break;
+			}
+			VMSTAT_ADD(vs_prefetched, swaponepageout(as, pg, frame));
+		}
+
+		spinlock_acquire(&prefetch_lock);
+		prefetch_current = NULL;
+		wchan_wakeall(prefetch_donewchan, &prefetch_lock);
+		spinlock_release(&prefetch_lock);
+		kfree(req);
+	}
+}
+
+static void prefetch_start(void) {
+	struct wchan* wc = wchan_create("prefetch");
+	struct wchan* donewc = wchan_create("prefetch_done");
+	if (wc == NULL || donewc == NULL
+			|| thread_fork("prefetch", NULL, prefetch_thread, NULL, 0)) {
+		kprintf("WARN no prefetch thread, MADV_WILLNEED is ignored\n");
+		if (wc != NULL) {
+			wchan_destroy(wc);
+		}
+		if (donewc != NULL) {
+			wchan_destroy(donewc);
+		}
+		return;
+	}
+	spinlock_acquire(&prefetch_lock);
+	prefetch_donewchan = donewc;
+	prefetch_wchan = wc;
+	spinlock_release(&prefetch_lock);
+}
+
+/* Queue [start, end) of the address space for the prefetch thread */
+static int prefetchQueue(struct addrspace* as, vaddr_t start, vaddr_t end) {
+	struct prefetch_req* req = kmalloc(sizeof(struct prefetch_req));
+	if (req == NULL) {
+		return ENOMEM;
+	}
+	req->pr_as = as;
+	req->pr_start = start;
+	req->pr_end = end;
+	req->pr_next = NULL;
+
+	spinlock_acquire(&prefetch_lock);
+	if (prefetch_wchan == NULL) {
+		spinlock_release(&prefetch_lock);
+		kfree(req);
+		return 0;
+	}
+	struct prefetch_req** link = &prefetch_queue;
+	while (*link != NULL) {
+		link = &(*link)->pr_next;
+	}
+	*link = req;
+	wchan_wakeone(prefetch_wchan, &prefetch_lock);
+	spinlock_release(&prefetch_lock);
+	return 0;
+}
+
+static bool prefetchOverlaps(struct prefetch_req* req, struct addrspace* as,
+		vaddr_t start, vaddr_t end) {
+	return req != NULL && req->pr_as == as && req->pr_start < end
+			&& start < req->pr_end;
+}
+
+void vm_prefetch_cancel(struct addrspace* as, vaddr_t start, vaddr_t end) {
+	struct prefetch_req* dropped = NULL;
+
+	spinlock_acquire(&prefetch_lock);
+	struct prefetch_req** link = &prefetch_queue;
+	while (*link != NULL) {
+		struct prefetch_req* req = *link;
+		if (prefetchOverlaps(req, as, start, end)) {
+			*link = req->pr_next;
+			req->pr_next = dropped;
+			dropped = req;
+		} else {
+			link = &req->pr_next;
+		}
+	}
+	while (prefetchOverlaps(prefetch_current, as, start, end)) {
+		prefetch_stop = true;
+		wchan_sleep(prefetch_donewchan, &prefetch_lock);
+	}
+	spinlock_release(&prefetch_lock);
+
+	while (dropped != NULL) {
+		struct prefetch_req* next = dropped->pr_next;
+		kfree(dropped);
+		dropped = next;
+	}
+}
+
+/*
+ * Eviction sleeps on the swap disk, so it is only attempted from a thread
+ * that may sleep and isn't already evicting (the swap I/O path can kmalloc).
+ */
+static bool canSwapForAlloc(void) {
+	return swap_state == SWAP_STATE_READY && !curthread->t_in_interrupt
+			&& curcpu->c_spinlocks == 0 && !lock_do_i_hold(swap_lock);
+}
+
+static struct cm_cpucache* cm_myCache(void) {
+	KASSERT(curcpu->c_number < CM_MAXCPUS);
+	return &cm_cpucache[curcpu->c_number];
+}
+
+/*
+ * Return a free frame to the buddy allocator. Called with coremap_lock
+ * held, for frames that are in neither the pool nor a cache any more.
+ */
+static void cm_releaseFrame(unsigned idx) {
+	cm_setEntryZeroedState(COREMAP(idx), false);
+	cm_buddyFreeBlock(idx, 0);
+	coremap_pages_free++;
+}
+
+static void cm_wakePageout(void) {
+	if (pageout_wchan != NULL && coremap_pages_free < pageout_lowater) {
+		wchan_wakeone(pageout_wchan, &coremap_lock);
+	}
+}
+
+/* Fill an empty cache, zeroed frames first. Called with cc_lock held */
+static void cm_cacheRefill(struct cm_cpucache* cc) {
+	spinlock_acquire(&coremap_lock);
+	while (cc->cc_count < CM_CPUCACHE_BATCH) {
+		int idx;
+		if (zero_pool_count > 0) {
+			idx = zero_pool[--zero_pool_count];
+		} else {
+			idx = cm_buddyAlloc(1);
+			if (idx == CM_NONE) {
+				break;
+			}
+		}
+		cc->cc_frames[cc->cc_count++] = idx;
+	}
+	cm_wakePageout();
+	spinlock_release(&coremap_lock);
+}
+
+/* Give up to n frames back to the buddy allocator. Called with cc_lock held */
+static void cm_cacheDrain(struct cm_cpucache* cc, unsigned n) {
+	spinlock_acquire(&coremap_lock);
+	while (n > 0 && cc->cc_count > 0) {
+		cm_releaseFrame(cc->cc_frames[--cc->cc_count]);
+		n--;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Empty every cache so the buddy allocator can coalesce their frames.
+ * Called without coremap_lock when an allocation would otherwise fail.
+ */
+static void cm_cacheDrainAll(void) {
+	unsigned i;
+	for (i = 0; i < CM_MAXCPUS; i++) {
+		spinlock_acquire(&cm_cpucache[i].cc_lock);
+		cm_cacheDrain(&cm_cpucache[i], CM_CPUCACHE_SIZE);
+		spinlock_release(&cm_cpucache[i].cc_lock);
+	}
+}
+
+/* Take a single frame from this cpu's cache, or CM_NONE */
+static int cm_cacheAlloc(void) {
+	int idx = CM_NONE;
+	struct cm_cpucache* cc = cm_myCache();
+	spinlock_acquire(&cc->cc_lock);
+	if (cc->cc_count == 0) {
+		cm_cacheRefill(cc);
+	}
+	if (cc->cc_count > 0) {
+		idx = cc->cc_frames[--cc->cc_count];
+	}
+	spinlock_release(&cc->cc_lock);
+	return idx;
+}
+
+/* Take frames from the buddy allocator, evicting pages if necessary */
+static int cm_globalAlloc(unsigned npages) {
+	bool canswap = canSwapForAlloc();
+	unsigned tries = 0;
+	int idx = CM_NONE;
+
+	spinlock_acquire(&coremap_lock);
+	if (npages == 1 && zero_pool_count > 0) {
+		idx = zero_pool[--zero_pool_count];
+	} else {
+		idx = cm_buddyAlloc(npages);
+	}
+	while (idx == CM_NONE && zero_pool_count > 0) {
+		// give the pool back before evicting, it may complete a block
+		cm_releaseFrame(zero_pool[--zero_pool_count]);
+		idx = cm_buddyAlloc(npages);
+	}
+	if (idx == CM_NONE && cm_cpucache_enabled) {
+		// so may the frames sitting in the cpu caches
+		spinlock_release(&coremap_lock);
+		cm_cacheDrainAll();
+		spinlock_acquire(&coremap_lock);
+		idx = cm_buddyAlloc(npages);
+	}
+	while (idx == CM_NONE && canswap && tries < page_count) {
+		// the pageout thread fell behind, evict synchronously. Other
+		// threads may take the frames we free, so try again
+		spinlock_release(&coremap_lock);
+		if (!swapin(npages)) {
+			spinlock_acquire(&coremap_lock);
+			break;
+		}
+		spinlock_acquire(&coremap_lock);
+		idx = cm_buddyAlloc(npages);
+		tries++;
+	}
+	cm_wakePageout();
+	spinlock_release(&coremap_lock);
+	return idx;
 }
 
-/* Fault handling function called by trap code */
-int vm_fault(int faulttype, vaddr_t faultaddress) {
-	struct addrspace* as = proc_getas();
-	if (as == NULL) {
-		//kprintf("AS was null\n");
-		return EFAULT;
+vaddr_t coremap_allocuserpages(unsigned npages, struct addrspace * as) {
+	int idx = CM_NONE;
+	if (npages == 1 && cm_cpucache_enabled) {
+		idx = cm_cacheAlloc();
 	}
-	struct region* reg = findRegionForFaultAddress(as, faultaddress);
-	if (reg == NULL) {
-		//kprintf("Region not found\n");
-		return EFAULT;
+	if (idx == CM_NONE) {
+		idx = cm_globalAlloc(npages);
 	}
-	// TODO Check if it is a permission issue and return an error code in that case.
-
-	// get page
-	struct page* pg = findPageForFaultAddress(as, faultaddress);
-	if (pg == NULL) {
-		struct page* newpage = page_create(as, faultaddress);
-		pg = newpage;
+	if (idx == CM_NONE) {
+		//kprintf("could not allocate %u\n", npages);
+		return 0;
 	}
-	if (pg == NULL) {
-		//kprintf("Failed to create a page\n");
-		return EFAULT;
+
+	// nobody else can reach these frames yet, see cm_cpucache
+	bool zeroed = cm_isEntryZeroed(COREMAP(idx));
+	unsigned k;
+	for (k = idx; k < idx + npages; k++) {
+		cm_setEntryZeroedState(COREMAP(k), false);
+		// a new page is clean, it matches what as_fill_page makes of it
+		cm_setEntryDirtyState(COREMAP(k), false);
+		cm_setEntrySwapSlot(COREMAP(k), -1);
+		cm_setEntryAddrspaceIdent(COREMAP(k), as);
+		// not evictable until the caller maps it with coremap_setpte
+		cm_setEntryPte(COREMAP(k), NULL);
+		cm_setEntryRefcount(COREMAP(k), 1);
 	}
-	if (pg->pt_state == PT_STATE_SWAPPED) {
-		//kprintf("Trying swap out from %x\n",pg->pt_pagebase);
-		//kprintf("Swap out page Vaddr = %x\n",pg->pt_virtbase);
-		swapout(as, pg);
-		//kprintf("after swap out paddr = %x\n",pg->pt_pagebase);
-		//kprintf("after Swap out Vaddr = %x\n", pg->pt_virtbase);
-		//kprintf("after Swap out state = %d\n",pg->pt_state);
+	cm_setEntryChunkSize(COREMAP(idx), npages);
+	membar_store_store();
+	for (k = idx; k < idx + npages; k++) {
+		// update the state
+		cm_setEntryUseState(COREMAP(k), true);
 	}
 
-	// load page address to tlb
-	int spl = splhigh();
-	tlb_random(pg->pt_virtbase * PAGE_SIZE,
-			(pg->pt_pagebase * PAGE_SIZE) | TLBLO_DIRTY | TLBLO_VALID);
-	splx(spl);
-	(void) faulttype;
-	return 0;
+	paddr_t output_paddr = cm_getEntryPaddr(idx);
+	if (zeroed) {
+		VMSTAT_INC(vs_prezeroed);
+	} else {
+		bzero(PADDR_TO_KVADDR((void* )output_paddr), npages * PAGE_SIZE);
+	}
+	return output_paddr;
 }
 
-vaddr_t coremap_allocuserpages(unsigned npages, struct addrspace * as) {
-	//kprintf("before inside cm alloc\n");
+/*
+ * Called from the idle loop in thread_switch with nothing to run, so it
+ * only takes spinlocks. Frames are only set aside while memory is above
+ * the pageout high watermark, the pool must not cause evictions.
+ */
+bool coremap_prezero(void) {
+	if (coremap == NULL) {
+		return false;
+	}
 	spinlock_acquire(&coremap_lock);
-	//kprintf("inside cm alloc\n");
-	unsigned i = 0, j = 0;
-
-	if (swap_state == SWAP_STATE_READY && coremap_pages_free == 0) {
-		swapin(npages, as);
+	if (zero_pool_count >= ZERO_POOL_SIZE
+			|| coremap_pages_free <= pageout_hiwater) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	int idx = cm_buddyAlloc(1);
+	spinlock_release(&coremap_lock);
+	if (idx == CM_NONE) {
+		return false;
 	}
 
-	// search for n continuous free pages
-	for (i = 0; i < page_count; i++) {
-		if (!cm_isEntryUsed(COREMAP(i))) {
-			for (j = i + 1; j < page_count && j - i < npages; j++) {
-				if (cm_isEntryUsed(COREMAP(j))) {
-					break;
-				}
-			}
-			if (j - i == npages) {
-				unsigned k = i;
-				for (; k < j; k++) {
-					// update the state
-					cm_setEntryUseState(COREMAP(k), true);
-					//cm_setEntryDirtyState(COREMAP(k), true);
-					// let the address space identifier be NULL for now
-					cm_setEntryAddrspaceIdent(COREMAP(k), as);
-					// chunk start would be the first page in the chunk
-					cm_setEntryChunkStart(COREMAP(k), i);
-				}
-				paddr_t output_paddr = cm_getEntryPaddr(i);
-				//kprintf("exiting cm alloc\n");
-				spinlock_release(&coremap_lock);
-				bzero(PADDR_TO_KVADDR((void* )output_paddr),
-						npages * PAGE_SIZE);
-				coremap_pages_free -= npages;
-				return output_paddr;
-			}
-		}
+	// the frame is in neither the buddy lists nor the pool while we clear it
+	bzero(PADDR_TO_KVADDR((void*) cm_getEntryPaddr(idx)), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	if (zero_pool_count < ZERO_POOL_SIZE) {
+		cm_setEntryZeroedState(COREMAP(idx), true);
+		zero_pool[zero_pool_count++] = idx;
+	} else {
+		// another cpu filled the pool meanwhile
+		cm_releaseFrame(idx);
 	}
-	//kprintf("could not allocate %u\n", npages);
 	spinlock_release(&coremap_lock);
-	return 0;
+	return true;
 }
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
@@ -536,54 +2710,83 @@ vaddr_t alloc_kpages(unsigned npages) {
 	return retval == 0 ? retval : PADDR_TO_KVADDR(retval);
 }
 
+/*
+ * Drop a reference to the chunk starting at coremap index i, freeing it
+ * with the last one. Called with coremap_lock held.
+ */
+static void cm_freeLocked(unsigned i) {
+	// a frame shared copy-on-write stays until its last owner lets go
+	if (cm_getEntryRefcount(COREMAP(i)) > 1) {
+		cm_setEntryRefcount(COREMAP(i), cm_getEntryRefcount(COREMAP(i)) - 1);
+		// we don't know which sharer is left, so the frame is not
+		// evicted until that sharer claims it on a write fault
+		cm_setEntryAddrspaceIdent(COREMAP(i), NULL);
+		cm_setEntryPte(COREMAP(i), NULL);
+		return;
+	}
+	// free all the pages in the chunk
+	unsigned npages = cm_getEntryChunkSize(COREMAP(i));
+	unsigned j;
+	for (j = i; j < i + npages; j++) {
+		// update the state
+		cm_setEntryUseState(COREMAP(j), false);
+		cm_dropSwapCopy(j);
+		pcache_remove(j);
+		cm_setEntryDirtyState(COREMAP(j), false);
+		// let the address space identifier be NULL initially
+		cm_setEntryAddrspaceIdent(COREMAP(j), NULL);
+		cm_setEntryPte(COREMAP(j), NULL);
+		cm_setEntryRefcount(COREMAP(j), 0);
+	}
+	cm_buddyFreeRange(i, npages);
+	coremap_pages_free += npages;
+}
+
 void coremap_freeuserpages(paddr_t addr) {
+	unsigned i = cm_getEntryIndex(addr);
+
+	// a single private frame goes to this cpu's cache. Only its owner can
+	// add sharers, so a refcount of 1 can't change under us. Other
+	// processes can find a frame in the page cache, so not those
+	if (cm_cpucache_enabled && cm_isEntryUsed(COREMAP(i))
+			&& cm_getEntryRefcount(COREMAP(i)) == 1
+			&& cm_getEntryChunkSize(COREMAP(i)) == 1
+			&& !cm_isEntryCached(COREMAP(i))) {
+		cm_setEntryUseState(COREMAP(i), false);
+		membar_store_store();
+		cm_dropSwapCopy(i);
+		cm_setEntryDirtyState(COREMAP(i), false);
+		cm_setEntryAddrspaceIdent(COREMAP(i), NULL);
+		cm_setEntryPte(COREMAP(i), NULL);
+		cm_setEntryRefcount(COREMAP(i), 0);
 
-	spinlock_acquire(&coremap_lock);
-	unsigned i;
-	for (i = 0; i < page_count; i++) {
-		// find the coremap entry to free
-		if (cm_getEntryPaddr(i) == addr) {
-			// free all the pages in the chunk
-			unsigned chunk_start = cm_getEntryChunkStart(COREMAP(i));
-			unsigned j = i;
-			while (j < page_count && cm_isEntryUsed(COREMAP(j))
-					&& cm_getEntryChunkStart(COREMAP(j)) == chunk_start) {
-				// update the state
-				cm_setEntryUseState(COREMAP(j), false);
-				//cm_setEntryDirtyState(COREMAP(j), false);
-				// let the address space identifier be NULL initially
-				cm_setEntryAddrspaceIdent(COREMAP(j), NULL);
-				coremap_pages_free++;
-				j++;
-			}
-			spinlock_release(&coremap_lock);
-			return;
+		struct cm_cpucache* cc = cm_myCache();
+		spinlock_acquire(&cc->cc_lock);
+		if (cc->cc_count == CM_CPUCACHE_SIZE) {
+			cm_cacheDrain(cc, CM_CPUCACHE_BATCH);
 		}
+		cc->cc_frames[cc->cc_count++] = i;
+		spinlock_release(&cc->cc_lock);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (!cm_isEntryUsed(COREMAP(i))) {
+		spinlock_release(&coremap_lock);
+		panic("free_pages() failed, %x is not allocated\n", addr);
 	}
+	cm_freeLocked(i);
 	spinlock_release(&coremap_lock);
-	panic("free_pages() failed, did not find the given vaddr\n");
-	(void) swapfree(0);
-	// to remove the function not used erro
-	(void) cm_getEntryAddrspaceIdent((struct core_map_entry *) (coremap));
-	(void) cm_isEntryDirty((struct core_map_entry *) (coremap));
 }
 
-void free_kpages(vaddr_t addr) {
-	coremap_freeuserpages(addr - MIPS_KSEG0);
+void coremap_setpte(paddr_t addr, struct page* pg) {
+	spinlock_acquire(&coremap_lock);
+	cm_setEntryPte(COREMAP(cm_getEntryIndex(addr)), pg);
+	spinlock_release(&coremap_lock);
 }
 
-void freePage(struct page* page) {
-	if(page->pt_state == PT_STATE_MAPPED) {
-		coremap_freeuserpages(page->pt_pagebase * PAGE_SIZE);
-		int spl = splhigh();
-		int tlbpos = tlb_probe(page->pt_pagebase * PAGE_SIZE, 0);
-		if (tlbpos >= 0) {
-			tlb_write(TLBHI_INVALID(tlbpos), TLBLO_INVALID(), tlbpos);
-		}
-		splx(spl);
-	} else if(page->pt_state == PT_STATE_MAPPED) {
-		swapfree(page);
-	}
+void free_kpages(vaddr_t addr) {
+	coremap_freeuserpages(addr - MIPS_KSEG0);
 }
 
 /*
@@ -592,44 +2795,248 @@ void freePage(struct page* page) {
  * to the caller. But it should have been correct at some point in time.
  */
 unsigned int coremap_used_bytes() {
-	spinlock_acquire(&coremap_lock);
-	// traverse the coremap and find the number of allocated pages
-	unsigned i, used_pages_count = 0;
-	for (i = 0; i < page_count; i++) {
-		if (cm_isEntryUsed(COREMAP(i))) {
-			used_pages_count++;
-		}
+	// every frame is used, free in the buddy allocator, pre-zeroed or
+	// cached, so count the small sets instead of walking the coremap
+	unsigned i, idle_pages_count = 0;
+	for (i = 0; i < CM_MAXCPUS; i++) {
+		idle_pages_count += cm_cpucache[i].cc_count;
 	}
+	spinlock_acquire(&coremap_lock);
+	idle_pages_count += coremap_pages_free + zero_pool_count;
 	spinlock_release(&coremap_lock);
-	return used_pages_count * PAGE_SIZE;
+	return (page_count - idle_pages_count) * PAGE_SIZE;
+}
+
+void vm_printstats() {
+	struct vm_stats stats;
+	spinlock_acquire(&vmstats_lock);
+	stats = vmstats;
+	spinlock_release(&vmstats_lock);
+
+	kprintf("vm faults:         %u\n", stats.vs_faults);
+	kprintf("zero-fill faults:  %u\n", stats.vs_zerofills);
+	kprintf("major faults:      %u\n", stats.vs_majorfaults);
+	kprintf("pages evicted:     %u\n", stats.vs_evictions);
+	kprintf("copy-on-write:     %u\n", stats.vs_cowcopies);
+	kprintf("swap writes:       %u\n", stats.vs_swapwrites);
+	kprintf("swap reads:        %u\n", stats.vs_swapreads);
+	kprintf("pages read ahead:  %u\n", stats.vs_readahead);
+	kprintf("pre-zeroed frames: %u used, %u ready\n", stats.vs_prezeroed,
+			zero_pool_count);
+	kprintf("clean evictions:   %u\n", stats.vs_cleanevictions);
+	kprintf("dropped refilled:  %u\n", stats.vs_refills);
+	kprintf("text page cache:   %u hits, %u misses\n", stats.vs_textshared,
+			stats.vs_textmisses);
+	kprintf("merged pages:      %u\n", stats.vs_merged);
+	kprintf("fault wait:        %u ms\n", stats.vs_faultwait / 1000);
+	kprintf("load control:      %u suspended\n", stats.vs_suspends);
+	kprintf("prefetched pages:  %u\n", stats.vs_prefetched);
+	kprintf("cleaned pages:     %u\n", stats.vs_cleaned);
+	kprintf("compressed pages:  %u stored, %u loaded, %u written back\n",
+			stats.vs_zstores, stats.vs_zloads, stats.vs_zwritebacks);
+	unsigned zpages, zused, zsize;
+	zswap_usage(&zpages, &zused, &zsize);
+	kprintf("compressed pool:   %u pages in %u of %u bytes\n", zpages, zused,
+			zsize);
+	kprintf("free frames:       %u of %u\n", coremap_pages_free, page_count);
+	kprintf("swap pages used:   %u of %d\n", swap_pages_used, swap_page_count);
 }
 
 /* TLB shootdown handling called from interprocessor_interrupt */
+/* Called from interprocessor_interrupt, interrupts are off */
 void vm_tlbshootdown_all() {
-// TODO implement this. but what is this?
+	int i;
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(curcpu->c_asid);
 }
 
 void vm_tlbshootdown(const struct tlbshootdown * tlb) {
-	(void) tlb;
-//TODO implement this. but what is this?
+	int tlbpos = tlb_probe(TLBHI_ASID(tlb->ts_vaddr, tlb->ts_asid), 0);
+	if (tlbpos >= 0) {
+		tlb_write(TLBHI_INVALID(tlbpos), TLBLO_INVALID(), tlbpos);
+	}
+	tlb_setasid(curcpu->c_asid);
 }
 
-static void removePagesWithinRegion(struct addrspace* as, struct region* reg) {
-	int pageCount = array_num(as->as_pagetable);
-	int i;
-	for (i = 0; i < pageCount; i++) {
-		struct page *pageCandidate = array_get(as->as_pagetable, i);
-		if (pageCandidate != NULL
-				&& pageCandidate->pt_virtbase >= reg->rg_vaddr / PAGE_SIZE
-				&& pageCandidate->pt_virtbase
-						<= (reg->rg_vaddr + reg->rg_size) / PAGE_SIZE) {
-			array_remove(as->as_pagetable, i);
-			freePage(pageCandidate);
-			kfree(pageCandidate);
-			i--;
-			pageCount = array_num(as->as_pagetable);
+/*
+ * Free the frames and swap pages of the pages in [start, end) and remove
+ * them from the page table. coremap_lock is taken once per FREE_BATCH
+ * pages rather than once per page. Their TLB entries are added to tb,
+ * unless it is NULL.
+ */
+#define FREE_BATCH 64
+
+static void freePages(struct addrspace* as, vaddr_t start, vaddr_t end,
+		struct tlb_batch* tb) {
+	vaddr_t cursor = start;
+	struct page* pg;
+	unsigned n = 0;
+
+	spinlock_acquire(&coremap_lock);
+	while ((pg = pagetable_next(as->as_pagetable, &cursor, end)) != NULL) {
+		while (pg->pt_state == PT_STATE_INTRANSIT) {
+			wchan_sleep(swap_transit_wchan, &coremap_lock);
+		}
+		if (pg->pt_state == PT_STATE_MAPPED) {
+			unsigned idx = cm_getEntryIndex(pg->pt_pagebase * PAGE_SIZE);
+			if (cm_getEntryPte(COREMAP(idx)) == pg) {
+				cm_setEntryPte(COREMAP(idx), NULL);
+			}
+			cm_freeLocked(idx);
+			if (tb != NULL) {
+				tlb_batch_add(tb, as, pg->pt_virtbase * PAGE_SIZE);
+			}
+		} else if (pg->pt_state == PT_STATE_SWAPPED) {
+			freeOneSwapPage(pg->pt_pagebase);
+		}
+		pg->pt_valid = 0;
+		if (++n % FREE_BATCH == 0) {
+			// let faults and the pageout thread in now and then
+			spinlock_release(&coremap_lock);
+			spinlock_acquire(&coremap_lock);
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void vm_freeall(struct addrspace* as) {
+	freePages(as, 0, USERSPACETOP, NULL);
+}
+
+void vm_unmap(struct addrspace* as, vaddr_t start, vaddr_t end) {
+	struct tlb_batch tb;
+	// the prefetch thread must not read pages back into the range
+	vm_prefetch_cancel(as, start, end);
+	tlb_batch_init(&tb);
+	freePages(as, start, end, &tb);
+	// before we return to user mode on a cpu that still maps them
+	tlb_batch_sync(&tb);
+}
+
+/* Write the file backed part of the page at vaddr from the frame */
+static int writeFilePage(struct region* reg, vaddr_t vaddr, paddr_t frame) {
+	vaddr_t end = reg->rg_vaddr + reg->rg_filesize;
+	if (end > vaddr + PAGE_SIZE) {
+		end = vaddr + PAGE_SIZE;
+	}
+	if (vaddr >= end) {
+		// past the end of the file, stays in memory only
+		return 0;
+	}
+	struct iovec iov;
+	struct uio ku;
+	uio_kinit(&iov, &ku, (void*) PADDR_TO_KVADDR(frame), end - vaddr,
+			reg->rg_offset + (vaddr - reg->rg_vaddr), UIO_WRITE);
+	lock_acquire(reg->rg_vnode->vn_opslock);
+	int result = VOP_WRITE(reg->rg_vnode, &ku);
+	lock_release(reg->rg_vnode->vn_opslock);
+	return result;
+}
+
+/*
+ * Write a dirty page of a shared mapping back to its file. A resident
+ * frame is detached from the page meanwhile so the pageout thread leaves
+ * it alone, and a page on disk is read into a scratch frame. The TLB entry
+ * goes into the batch so that the next write faults and dirties the page
+ * again.
+ */
+static int writebackPage(struct addrspace* as, struct region* reg,
+		struct page* pg, struct tlb_batch* tb) {
+	vaddr_t vaddr = pg->pt_virtbase * PAGE_SIZE;
+	paddr_t frame = 0;
+	bool detached = false;
+
+	spinlock_acquire(&coremap_lock);
+	while (pg->pt_state == PT_STATE_INTRANSIT) {
+		wchan_sleep(swap_transit_wchan, &coremap_lock);
+	}
+	if (!pg->pt_dirty) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	pg->pt_dirty = 0;
+	if (pg->pt_state == PT_STATE_MAPPED) {
+		frame = pg->pt_pagebase * PAGE_SIZE;
+		unsigned idx = cm_getEntryIndex(frame);
+		if (cm_getEntryPte(COREMAP(idx)) == pg) {
+			cm_setEntryPte(COREMAP(idx), NULL);
+			detached = true;
+		}
+	}
+	spinlock_release(&coremap_lock);
+	tlb_batch_add(tb, as, vaddr);
+
+	int result = 0;
+	bool swapped = pg->pt_state == PT_STATE_SWAPPED;
+	if (swapped) {
+		// keep the prefetcher from reading it back while we copy the slot
+		if (!claimSwapped(pg, pg->pt_pagebase)) {
+			// it is being read back already, write the frame instead
+			spinlock_acquire(&coremap_lock);
+			pg->pt_dirty = 1;
+			spinlock_release(&coremap_lock);
+			return writebackPage(as, reg, pg, tb);
+		}
+		frame = coremap_allocuserpages(1, NULL);
+		if (frame == 0) {
+			result = ENOMEM;
+		} else {
+			lock_acquire(swap_lock);
+			result = swap_io(pg->pt_pagebase, &frame, 1, UIO_READ);
+			lock_release(swap_lock);
+		}
+	}
+	if (!result) {
+		result = writeFilePage(reg, vaddr, frame);
+	}
+	if (swapped) {
+		if (frame != 0) {
+			coremap_freeuserpages(frame);
+		}
+		spinlock_acquire(&coremap_lock);
+		pg->pt_state = PT_STATE_SWAPPED;
+		wchan_wakeall(swap_transit_wchan, &coremap_lock);
+		spinlock_release(&coremap_lock);
+	}
+	if (detached) {
+		coremap_setpte(frame, pg);
+	}
+	if (result) {
+		spinlock_acquire(&coremap_lock);
+		pg->pt_dirty = 1;
+		spinlock_release(&coremap_lock);
+	}
+	return result;
+}
+
+int vm_msync(struct addrspace* as, vaddr_t start, vaddr_t end) {
+	int result = 0;
+	unsigned i;
+	struct tlb_batch tb;
+	tlb_batch_init(&tb);
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		struct region* reg = array_get(as->as_regions, i);
+		if (!reg->shared) {
+			continue;
+		}
+		vaddr_t cursor = reg->rg_vaddr > start ? reg->rg_vaddr : start;
+		vaddr_t stop = reg->rg_vaddr + reg->rg_size;
+		if (stop > end) {
+			stop = end;
+		}
+		struct page* pg;
+		while (cursor < stop
+				&& (pg = pagetable_next(as->as_pagetable, &cursor, stop)) != NULL) {
+			int err = writebackPage(as, reg, pg, &tb);
+			if (err && !result) {
+				result = err;
+			}
 		}
 	}
+	tlb_batch_sync(&tb);
+	return result;
 }
 
 /*static void invalidateTlb() {
@@ -641,45 +3048,6 @@ static void removePagesWithinRegion(struct addrspace* as, struct region* reg) {
 	splx(spl);
 }*/
 
-static int reduceHeapSize(userptr_t amount, int32_t* retval,
-		struct addrspace* as) {
-	vaddr_t newStart = as->as_addrPtr + (vaddr_t) amount;
-	vaddr_t oldStart = as->as_addrPtr;
-	unsigned int regionCount = array_num(as->as_regions);
-	unsigned int i;
-	if (as->as_heapBase > newStart) {
-		//kprintf("Invalid because it falls within code page %x\n",
-		//		codepage->rg_vaddr + codepage->rg_size);
-		*retval = -1;
-		return ENOMEM;
-	}
-	for (i = 0; i < regionCount; i++) {
-		struct region* reg = array_get(as->as_regions, i);
-		if (reg != NULL && reg->rg_vaddr >= as->as_stackBase
-				&& reg->rg_vaddr + reg->rg_size >= as->as_stackBase) {
-			continue;
-		}
-		if (reg != NULL && reg->rg_vaddr >= newStart) {
-			removePagesWithinRegion(as, reg);
-			array_remove(as->as_regions, i);
-			kfree(reg);
-			i--;
-			regionCount = array_num(as->as_regions);
-		} else if (reg != NULL && reg->rg_vaddr <= newStart
-				&& reg->rg_vaddr + reg->rg_size >= newStart) {
-			struct region tempReg;
-			tempReg.rg_vaddr = newStart;
-			tempReg.rg_size = newStart - (reg->rg_vaddr + reg->rg_size);
-			reg->rg_size = newStart - reg->rg_vaddr;
-			removePagesWithinRegion(as, &tempReg);
-		}
-	}
-	as->as_addrPtr = newStart;
-	*retval = oldStart;
-	//kprintf("retval is = %x\n", as->as_addrPtr);
-	return 0;
-}
-
 int sys_sbrk(userptr_t amount, int32_t* retval) {
 	*retval = 0;
 	if ((int) amount % PAGE_SIZE != 0) {
@@ -691,28 +3059,274 @@ int sys_sbrk(userptr_t amount, int32_t* retval) {
 		return ENOMEM;
 	}
 	struct addrspace* as = proc_getas();
-	//kprintf("SBRK CALLED WITH PARAMS %x, newregion start = %x\n", (int) amount,
-	//				as->as_addrPtr);
 	if (as->as_heapBase == 0) {
 		as->as_heapBase = as->as_addrPtr;
 	}
+	vaddr_t oldBreak = as->as_addrPtr;
 	if (amount == 0) {
-		*retval = as->as_addrPtr;
+		*retval = oldBreak;
 		return 0;
 	}
+	vaddr_t newBreak = oldBreak + (vaddr_t) amount;
 
 	if ((int) amount < 0) {
-		if ((int) (amount + as->as_addrPtr) < (int) (as->as_heapBase)) {
+		if ((int) newBreak < (int) as->as_heapBase) {
 			*retval = -1;
 			return EINVAL;
 		}
-		return reduceHeapSize(amount, retval, as);
+		// only the pages that exist are visited, with one TLB sync
+		vm_unmap(as, newBreak, oldBreak);
+	} else if (!as_range_free(as, oldBreak, (size_t) amount)) {
+		// would run into a mapping or the stack
+		*retval = -1;
+		return ENOMEM;
+	}
+	int result = as_set_break(as, newBreak);
+	if (result) {
+		*retval = -1;
+		return result;
+	}
+	*retval = oldBreak;
+	return 0;
+}
+
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+		userptr_t stackargs, int32_t* retval) {
+	*retval = -1;
+	// the fd and the 64-bit offset are passed on the stack
+	int fd;
+	off_t offset;
+	int result = copyin(stackargs, &fd, sizeof(int));
+	if (result) {
+		return result;
+	}
+	result = copyin((userptr_t) ((vaddr_t) stackargs + 8), &offset, sizeof(off_t));
+	if (result) {
+		return result;
+	}
+
+	int type = flags & (MAP_SHARED | MAP_PRIVATE);
+	if (len == 0 || (type != MAP_SHARED && type != MAP_PRIVATE)
+			|| (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON))
+			|| (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+		return EINVAL;
+	}
+	if (type == MAP_SHARED && (flags & MAP_ANON)) {
+		// pages are shared through their file, there is none to share
+		return EINVAL;
+	}
+	size_t size = ROUNDUP(len, PAGE_SIZE);
+	if (size < len) {
+		return ENOMEM;
+	}
+
+	struct vnode* v = NULL;
+	size_t filesize = 0;
+	if (!(flags & MAP_ANON)) {
+		if (offset < 0 || offset % PAGE_SIZE != 0) {
+			return EINVAL;
+		}
+		struct filetable_entry* entry = filetable_lookup(curproc->p_filetable, fd);
+		if (entry == NULL) {
+			return EBADF;
+		}
+		struct file_handle* handle = entry->ft_handle;
+		int accmode = handle->fh_permission & O_ACCMODE;
+		if (accmode == O_WRONLY) {
+			return EACCES;
+		}
+		if (type == MAP_SHARED && (prot & PROT_WRITE) && accmode != O_RDWR) {
+			return EACCES;
+		}
+		v = handle->fh_vnode;
+		result = VOP_MMAP(v);
+		if (result) {
+			return result;
+		}
+		struct stat st;
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		// pages past the end of the file are zero filled
+		if (st.st_size > offset) {
+			filesize = st.st_size - offset < (off_t) size ?
+					(size_t) (st.st_size - offset) : size;
+		}
+	}
+
+	struct addrspace* as = proc_getas();
+	vaddr_t vaddr = as_find_free_range(as, (vaddr_t) addr, size);
+	if (vaddr == 0) {
+		return ENOMEM;
+	}
+	result = as_define_mapping(as, vaddr, size, filesize, v, offset,
+			prot & PROT_READ, prot & PROT_WRITE, prot & PROT_EXEC,
+			type == MAP_SHARED);
+	if (result) {
+		return result;
+	}
+	*retval = vaddr;
+	return 0;
+}
+
+/* Check a page aligned user range and return its end rounded up to a page */
+static int mappingRangeEnd(userptr_t addr, size_t len, vaddr_t* end) {
+	vaddr_t start = (vaddr_t) addr;
+	if (start % PAGE_SIZE != 0 || len == 0 || start >= USERSPACETOP
+			|| len > USERSPACETOP - start) {
+		return EINVAL;
+	}
+	*end = ROUNDUP(start + len, PAGE_SIZE);
+	return 0;
+}
+
+int sys_munmap(userptr_t addr, size_t len, int32_t* retval) {
+	*retval = -1;
+	vaddr_t end;
+	int result = mappingRangeEnd(addr, len, &end);
+	if (result) {
+		return result;
+	}
+	result = as_remove_mapping(proc_getas(), (vaddr_t) addr, end);
+	if (result) {
+		return result;
+	}
+	*retval = 0;
+	return 0;
+}
+
+int sys_msync(userptr_t addr, size_t len, int flags, int32_t* retval) {
+	*retval = -1;
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE))
+			|| (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+	vaddr_t end;
+	int result = mappingRangeEnd(addr, len, &end);
+	if (result) {
+		return result;
+	}
+	// there is no writeback thread, MS_ASYNC writes synchronously too
+	result = vm_msync(proc_getas(), (vaddr_t) addr, end);
+	if (result) {
+		return result;
+	}
+	*retval = 0;
+	return 0;
+}
+
+/* Set the read-ahead advice of the pages in [start, end) that exist */
+static void setAdvice(struct addrspace* as, vaddr_t start, vaddr_t end,
+		int advice) {
+	vaddr_t cursor = start;
+	struct page* pg;
+	while ((pg = pagetable_next(as->as_pagetable, &cursor, end)) != NULL) {
+		// the other fields of the entry change under the lock
+		spinlock_acquire(&coremap_lock);
+		pg->pt_advice = advice;
+		spinlock_release(&coremap_lock);
+	}
+}
+
+/*
+ * Read in the file backed pages of [start, end) that aren't in memory.
+ * The region and page table of the address space may only be changed by
+ * its own thread, so unlike swapped pages these can't be left to the
+ * prefetch thread and are brought in before madvise returns.
+ */
+static void prefetchFilePages(struct addrspace* as, vaddr_t start,
+		vaddr_t end) {
+	vaddr_t vaddr;
+	for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+		if (coremap_pages_free <= pageout_hiwater) {
+			break;
+		}
+		struct region* reg = as_find_region(as, vaddr);
+		if (reg == NULL || reg->rg_vnode == NULL) {
+			continue;
+		}
+		struct page* pg = pagetable_lookup(as->as_pagetable, vaddr);
+		if (pg != NULL && pg->pt_state != PT_STATE_DROPPED) {
+			continue;
+		}
+		// only a hint, a page that can't be read now faults later
+		if (vm_fault(VM_FAULT_READ, vaddr) == 0) {
+			VMSTAT_INC(vs_prefetched);
+		}
+	}
+}
 
+int sys_madvise(userptr_t addr, size_t len, int advice, int32_t* retval) {
+	*retval = -1;
+	vaddr_t end;
+	int result = mappingRangeEnd(addr, len, &end);
+	if (result) {
+		return result;
+	}
+	struct addrspace* as = proc_getas();
+	vaddr_t start = (vaddr_t) addr;
+	if (!as_range_mapped(as, start, end)) {
+		return ENOMEM;
+	}
+	switch (advice) {
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+		setAdvice(as, start, end, advice);
+		break;
+	case MADV_WILLNEED:
+		prefetchFilePages(as, start, end);
+		result = prefetchQueue(as, start, end);
+		break;
+	case MADV_DONTNEED:
+		// dirty shared pages reach their file first, the rest is dropped
+		// and reads back zero filled or from the file
+		result = vm_msync(as, start, end);
+		if (!result) {
+			vm_unmap(as, start, end);
+		}
+		break;
+	default:
+		return EINVAL;
+	}
+	if (result) {
+		return result;
 	}
+	*retval = 0;
+	return 0;
+}
 
-	vaddr_t newRegionStart = as->as_addrPtr;
-	as_define_region(as, newRegionStart, (int) amount, 1, 1, 0);
+#define MINCORE_CHUNK 64
 
-	*retval = newRegionStart;
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec, int32_t* retval) {
+	*retval = -1;
+	vaddr_t end;
+	int result = mappingRangeEnd(addr, len, &end);
+	if (result) {
+		return result;
+	}
+	struct addrspace* as = proc_getas();
+	if (!as_range_mapped(as, (vaddr_t) addr, end)) {
+		return ENOMEM;
+	}
+	// one byte per page, 1 if it is resident when we look
+	char buf[MINCORE_CHUNK];
+	vaddr_t vaddr = (vaddr_t) addr;
+	vaddr_t out = (vaddr_t) vec;
+	while (vaddr < end) {
+		unsigned n;
+		for (n = 0; n < MINCORE_CHUNK && vaddr < end; n++) {
+			struct page* pg = pagetable_lookup(as->as_pagetable, vaddr);
+			buf[n] = pg != NULL && pg->pt_state == PT_STATE_MAPPED;
+			vaddr += PAGE_SIZE;
+		}
+		result = copyout(buf, (userptr_t) out, n);
+		if (result) {
+			return result;
+		}
+		out += n;
+	}
+	*retval = 0;
 	return 0;
 }
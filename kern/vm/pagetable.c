@@ -0,0 +1,90 @@
+/**
+ * pagetable.c
+ *
+ * Implements methods defined in pagetable.h
+ *
+ */
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+
+struct pagetable* pagetable_create() {
+	// the directory and every leaf must fit in a single page
+	COMPILE_ASSERT(sizeof(struct pagetable) <= PAGE_SIZE);
+	COMPILE_ASSERT(sizeof(struct page) * PT_L2_SIZE == PAGE_SIZE);
+
+	struct pagetable* pt = (struct pagetable*) kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	bzero(pt, sizeof(struct pagetable));
+	return pt;
+}
+
+void pagetable_destroy(struct pagetable* pt) {
+	unsigned i;
+	for (i = 0; i < PT_L1_SIZE; i++) {
+		if (pt->pt_leaves[i] != NULL) {
+			kfree(pt->pt_leaves[i]);
+		}
+	}
+	kfree(pt);
+}
+
+struct page* pagetable_lookup(struct pagetable* pt, vaddr_t vaddr) {
+	KASSERT(vaddr < USERSPACETOP);
+	struct page* leaf = pt->pt_leaves[PT_L1_INDEX(vaddr)];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	struct page* pg = &leaf[PT_L2_INDEX(vaddr)];
+	return pg->pt_valid ? pg : NULL;
+}
+
+struct page* pagetable_insert(struct pagetable* pt, vaddr_t vaddr) {
+	KASSERT(vaddr < USERSPACETOP);
+	struct page* leaf = pt->pt_leaves[PT_L1_INDEX(vaddr)];
+	if (leaf == NULL) {
+		leaf = (struct page*) kmalloc(PAGE_SIZE);
+		if (leaf == NULL) {
+			return NULL;
+		}
+		bzero(leaf, PAGE_SIZE);
+		pt->pt_leaves[PT_L1_INDEX(vaddr)] = leaf;
+	}
+	struct page* pg = &leaf[PT_L2_INDEX(vaddr)];
+	bzero(pg, sizeof(struct page));
+	pg->pt_virtbase = vaddr / PAGE_SIZE;
+	pg->pt_valid = 1;
+	return pg;
+}
+
+void pagetable_remove(struct pagetable* pt, vaddr_t vaddr) {
+	struct page* pg = pagetable_lookup(pt, vaddr);
+	if (pg != NULL) {
+		pg->pt_valid = 0;
+	}
+}
+
+struct page* pagetable_next(struct pagetable* pt, vaddr_t* cursor, vaddr_t end) {
+	if (end > USERSPACETOP) {
+		end = USERSPACETOP;
+	}
+	vaddr_t vaddr = *cursor & PAGE_FRAME;
+	while (vaddr < end) {
+		struct page* leaf = pt->pt_leaves[PT_L1_INDEX(vaddr)];
+		if (leaf == NULL) {
+			// skip to the first page covered by the next leaf
+			vaddr = PT_VADDR(PT_L1_INDEX(vaddr) + 1, 0);
+			continue;
+		}
+		struct page* pg = &leaf[PT_L2_INDEX(vaddr)];
+		vaddr += PAGE_SIZE;
+		if (pg->pt_valid) {
+			*cursor = vaddr;
+			return pg;
+		}
+	}
+	*cursor = end;
+	return NULL;
+}
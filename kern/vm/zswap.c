@@ -0,0 +1,339 @@
+/**
+ * zswap.c
+ *
+ * Implements methods defined in zswap.h
+ *
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <zswap.h>
+
+/*
+ * Pages are compressed with a small LZ77 coder in the LZF format: a
+ * control byte below 32 is followed by that many plus one literal bytes,
+ * anything else is a back reference of 3 to 264 bytes up to 8 KB back.
+ * It needs no state beyond a hash table of recent positions, and
+ * decompressing is a plain copy loop.
+ */
+#define ZSWAP_HLOG 12
+#define ZSWAP_MAXOFF 8192
+#define ZSWAP_MAXLEN (7 + 255 + 2)
+#define ZSWAP_MAXLIT 32
+
+// a page that compresses worse than this goes to the disk as it is
+#define ZSWAP_MAXSIZE (PAGE_SIZE * 3 / 4)
+
+// objects in the log are this aligned, the header always fits before the end
+#define ZSWAP_ALIGN 16
+
+// pool bytes per hash bucket, about what a compressed page takes
+#define ZSWAP_BUCKET_BYTES 1024
+
+struct zswap_obj {
+	int zo_slot;             // -1 for holes and the padding before the log wraps
+	uint32_t zo_next;        // offset plus one of the next page in the bucket
+	unsigned zo_len;         // compressed bytes following the header
+	unsigned zo_size;        // bytes taken in the log, header included
+};
+
+// compressor state, only used by zswap_store which callers serialize
+static uint16_t zswap_htab[1 << ZSWAP_HLOG];
+static uint8_t zswap_scratch[ZSWAP_MAXSIZE];
+
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+static uint8_t* zswap_pool = NULL;
+static unsigned zswap_size;
+static unsigned zswap_head = 0;
+static unsigned zswap_tail = 0;
+static unsigned zswap_used = 0;
+static unsigned zswap_count = 0;
+
+/*
+ * The pages in the pool are found by slot through a hash table, chained
+ * through their headers. It is sized to the pool rather than to the swap
+ * disk, which has many more slots than the pool can ever hold pages.
+ * Each bucket holds the log offset plus one of its first page, 0 if none.
+ */
+static uint32_t* zswap_buckets;
+static unsigned zswap_nbuckets; // a power of two
+static unsigned zswap_nslots;
+
+static unsigned zswap_hash(const uint8_t* p) {
+	uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+	return (v * 2654435761U) >> (32 - ZSWAP_HLOG);
+}
+
+/* Append n literal bytes, or return NULL if they don't fit */
+static uint8_t* zswap_literals(uint8_t* op, uint8_t* oend, const uint8_t* lit,
+		unsigned n) {
+	while (n > 0) {
+		unsigned run = n < ZSWAP_MAXLIT ? n : ZSWAP_MAXLIT;
+		if (op + 1 + run > oend) {
+			return NULL;
+		}
+		*op++ = run - 1;
+		memcpy(op, lit, run);
+		op += run;
+		lit += run;
+		n -= run;
+	}
+	return op;
+}
+
+/* Compress a page into out, returns the length or 0 if it needs more than outmax */
+static size_t zswap_compress(const uint8_t* in, uint8_t* out, size_t outmax) {
+	const uint8_t* ip = in;
+	const uint8_t* end = in + PAGE_SIZE;
+	const uint8_t* lit = in;
+	uint8_t* op = out;
+	uint8_t* oend = out + outmax;
+
+	bzero(zswap_htab, sizeof(zswap_htab));
+	while (ip + 2 < end) {
+		unsigned h = zswap_hash(ip);
+		const uint8_t* ref = in + zswap_htab[h] - 1;
+		bool found = zswap_htab[h] != 0;
+		zswap_htab[h] = ip - in + 1;
+		if (!found || ip - ref > ZSWAP_MAXOFF || ref[0] != ip[0]
+				|| ref[1] != ip[1] || ref[2] != ip[2]) {
+			ip++;
+			continue;
+		}
+		unsigned len = 3;
+		unsigned maxlen = end - ip < ZSWAP_MAXLEN ? end - ip : ZSWAP_MAXLEN;
+		while (len < maxlen && ref[len] == ip[len]) {
+			len++;
+		}
+		op = zswap_literals(op, oend, lit, ip - lit);
+		if (op == NULL || op + 3 > oend) {
+			return 0;
+		}
+		unsigned off = ip - ref - 1;
+		unsigned l = len - 2;
+		if (l < 7) {
+			*op++ = (l << 5) | (off >> 8);
+		} else {
+			*op++ = (7 << 5) | (off >> 8);
+			*op++ = l - 7;
+		}
+		*op++ = off & 0xff;
+		ip += len;
+		lit = ip;
+	}
+	op = zswap_literals(op, oend, lit, end - lit);
+	if (op == NULL) {
+		return 0;
+	}
+	return op - out;
+}
+
+static void zswap_decompress(const uint8_t* in, size_t inlen, uint8_t* out) {
+	const uint8_t* iend = in + inlen;
+	uint8_t* op = out;
+	while (in < iend) {
+		unsigned ctrl = *in++;
+		if (ctrl < ZSWAP_MAXLIT) {
+			memcpy(op, in, ctrl + 1);
+			op += ctrl + 1;
+			in += ctrl + 1;
+			continue;
+		}
+		unsigned len = ctrl >> 5;
+		if (len == 7) {
+			len += *in++;
+		}
+		len += 2;
+		const uint8_t* ref = op - ((ctrl & 0x1f) << 8) - *in++ - 1;
+		// byte by byte, the reference may overlap what it produces
+		while (len-- > 0) {
+			*op++ = *ref++;
+		}
+	}
+	KASSERT(op == out + PAGE_SIZE);
+}
+
+static struct zswap_obj* zswap_obj(unsigned off) {
+	return (struct zswap_obj*) (zswap_pool + off);
+}
+
+static uint32_t* zswap_bucket(int slot) {
+	return &zswap_buckets[(unsigned) slot & (zswap_nbuckets - 1)];
+}
+
+/* Return the log offset plus one of the slot's page, 0 if it isn't in the pool */
+static uint32_t zswap_find(int slot) {
+	uint32_t e = *zswap_bucket(slot);
+	while (e != 0 && zswap_obj(e - 1)->zo_slot != slot) {
+		e = zswap_obj(e - 1)->zo_next;
+	}
+	return e;
+}
+
+/* Take the slot's page out of its bucket, leaving a hole in the log */
+static void zswap_unlink(int slot) {
+	uint32_t* link = zswap_bucket(slot);
+	while (zswap_obj(*link - 1)->zo_slot != slot) {
+		link = &zswap_obj(*link - 1)->zo_next;
+		KASSERT(*link != 0);
+	}
+	struct zswap_obj* obj = zswap_obj(*link - 1);
+	*link = obj->zo_next;
+	obj->zo_slot = -1;
+}
+
+/* Reserve need bytes at the head, padding to the end first if they don't fit there */
+static bool zswap_reserve(unsigned need, unsigned* off) {
+	if (zswap_used == 0) {
+		zswap_head = zswap_tail = 0;
+	}
+	if (zswap_used == zswap_size) {
+		return false;
+	}
+	if (zswap_head >= zswap_tail) {
+		unsigned atend = zswap_size - zswap_head;
+		if (need > atend) {
+			if (need > zswap_tail) {
+				return false;
+			}
+			zswap_obj(zswap_head)->zo_slot = -1;
+			zswap_obj(zswap_head)->zo_size = atend;
+			zswap_used += atend;
+			zswap_head = 0;
+		}
+	} else if (need > zswap_tail - zswap_head) {
+		return false;
+	}
+	*off = zswap_head;
+	zswap_head = (zswap_head + need) % zswap_size;
+	zswap_used += need;
+	return true;
+}
+
+/* Drop the object at the tail */
+static void zswap_advance(void) {
+	unsigned size = zswap_obj(zswap_tail)->zo_size;
+	zswap_tail = (zswap_tail + size) % zswap_size;
+	zswap_used -= size;
+}
+
+/* Skip the holes and padding at the tail */
+static void zswap_trim(void) {
+	while (zswap_used > 0) {
+		struct zswap_obj* obj = zswap_obj(zswap_tail);
+		if (obj->zo_slot >= 0) {
+			break;
+		}
+		zswap_advance();
+	}
+}
+
+int zswap_init(void* pool, size_t size, unsigned nslots) {
+	KASSERT(size % ZSWAP_ALIGN == 0);
+	COMPILE_ASSERT(sizeof(struct zswap_obj) == ZSWAP_ALIGN);
+	unsigned nbuckets = 1;
+	while (nbuckets * ZSWAP_BUCKET_BYTES < size) {
+		nbuckets *= 2;
+	}
+	zswap_buckets = kmalloc(nbuckets * sizeof(uint32_t));
+	if (zswap_buckets == NULL) {
+		return ENOMEM;
+	}
+	bzero(zswap_buckets, nbuckets * sizeof(uint32_t));
+	zswap_nbuckets = nbuckets;
+	zswap_nslots = nslots;
+	zswap_size = size;
+	zswap_pool = pool;
+	return 0;
+}
+
+int zswap_store(int slot, const void* page) {
+	KASSERT(slot >= 0 && (unsigned) slot < zswap_nslots);
+	size_t len = zswap_compress(page, zswap_scratch, ZSWAP_MAXSIZE);
+	if (len == 0) {
+		return E2BIG;
+	}
+	unsigned need = ROUNDUP(sizeof(struct zswap_obj) + len, ZSWAP_ALIGN);
+	if (need > zswap_size) {
+		return E2BIG;
+	}
+
+	spinlock_acquire(&zswap_lock);
+	KASSERT(zswap_find(slot) == 0);
+	unsigned off;
+	if (!zswap_reserve(need, &off)) {
+		spinlock_release(&zswap_lock);
+		return ENOSPC;
+	}
+	struct zswap_obj* obj = zswap_obj(off);
+	obj->zo_slot = slot;
+	obj->zo_len = len;
+	obj->zo_size = need;
+	memcpy(obj + 1, zswap_scratch, len);
+	obj->zo_next = *zswap_bucket(slot);
+	*zswap_bucket(slot) = off + 1;
+	zswap_count++;
+	spinlock_release(&zswap_lock);
+	return 0;
+}
+
+bool zswap_load(int slot, void* page) {
+	KASSERT(slot >= 0 && (unsigned) slot < zswap_nslots);
+	spinlock_acquire(&zswap_lock);
+	uint32_t e = zswap_find(slot);
+	if (e == 0) {
+		spinlock_release(&zswap_lock);
+		return false;
+	}
+	// under the lock, the writeback may want the space back
+	struct zswap_obj* obj = zswap_obj(e - 1);
+	zswap_decompress((uint8_t*) (obj + 1), obj->zo_len, page);
+	spinlock_release(&zswap_lock);
+	return true;
+}
+
+void zswap_invalidate(int slot) {
+	KASSERT(slot >= 0 && (unsigned) slot < zswap_nslots);
+	spinlock_acquire(&zswap_lock);
+	if (zswap_find(slot) != 0) {
+		zswap_unlink(slot);
+		zswap_count--;
+		zswap_trim();
+	}
+	spinlock_release(&zswap_lock);
+}
+
+int zswap_writeback(void* page) {
+	int slot = -1;
+	spinlock_acquire(&zswap_lock);
+	zswap_trim();
+	if (zswap_used > 0) {
+		struct zswap_obj* obj = zswap_obj(zswap_tail);
+		zswap_decompress((uint8_t*) (obj + 1), obj->zo_len, page);
+		slot = obj->zo_slot;
+	}
+	spinlock_release(&zswap_lock);
+	return slot;
+}
+
+void zswap_writeback_done(int slot) {
+	spinlock_acquire(&zswap_lock);
+	// unless the slot was freed meanwhile, its page is still the oldest
+	if (zswap_find(slot) == zswap_tail + 1) {
+		zswap_unlink(slot);
+		zswap_count--;
+		zswap_advance();
+		zswap_trim();
+	}
+	spinlock_release(&zswap_lock);
+}
+
+void zswap_usage(unsigned* npages, unsigned* used, unsigned* size) {
+	spinlock_acquire(&zswap_lock);
+	*npages = zswap_count;
+	*used = zswap_used;
+	*size = zswap_pool == NULL ? 0 : zswap_size;
+	spinlock_release(&zswap_lock);
+}
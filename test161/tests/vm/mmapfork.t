@@ -0,0 +1,15 @@
+---
+name: "mmap Fork"
+description: >
+  Check that a MAP_SHARED file mapping stays shared between parent
+  and child after fork.
+tags: [vm]
+depends: [not-dumbvm-vm, shell]
+sys161:
+  ram: 2M
+monitor:
+  progresstimeout: 15.0
+---
+khu
+$ /testbin/mmapfork
+khu
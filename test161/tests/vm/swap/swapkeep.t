@@ -0,0 +1,21 @@
+---
+name: "Swap Keep"
+description: >
+  Read pages back from a nearly full swap disk and evict them again,
+  checking that they keep their contents.
+tags: [swap]
+depends: [swap-basic, shell]
+sys161:
+  cpus: 2
+  ram: 1M
+  disk1:
+    enabled: true
+    bytes: 8M
+monitor:
+  progresstimeout: 40.0
+misc:
+  prompttimeout: 3600.0
+---
+khu
+$ /testbin/swapkeep 1900
+khu
@@ -0,0 +1,109 @@
+/*
+ * mmapfork.c
+ *
+ *	Tests that a MAP_SHARED mapping stays shared across fork: the child
+ *	writes to the mapping and the parent must see the writes, and the
+ *	file must have them after msync. The parent only touches the first
+ *	page before forking, so pages that aren't in memory yet are covered
+ *	too.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <test161/test161.h>
+
+#define FILENAME	"mmapfork.dat"
+#define PageSize	4096
+#define NumPages	4
+#define MapSize		(NumPages * PageSize)
+
+static
+void
+fail(const char *msg, int page)
+{
+	tprintf("mmapfork: page %d: %s\n", page, msg);
+	success(TEST161_FAIL, SECRET, "/testbin/mmapfork");
+	exit(1);
+}
+
+int
+main(void)
+{
+	static char buf[MapSize];
+	volatile char *map;
+	int fd, status, i;
+	pid_t pid;
+
+	fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	memset(buf, 'a', sizeof(buf));
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		err(1, "%s: write", FILENAME);
+	}
+
+	map = mmap(NULL, MapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	/* resident before the fork, the other pages are not */
+	map[0] = 'p';
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (map[0] != 'p') {
+			_exit(2);
+		}
+		for (i=0; i<NumPages; i++) {
+			map[i*PageSize + 1] = 'c';
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fail("child didn't see the parent's write", 0);
+	}
+
+	for (i=0; i<NumPages; i++) {
+		if (map[i*PageSize + 1] != 'c') {
+			fail("parent didn't see the child's write", i);
+		}
+	}
+
+	/* and the file gets what both sides wrote */
+	if (msync((void *)map, MapSize, MS_SYNC) < 0) {
+		err(1, "msync");
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		err(1, "%s: read", FILENAME);
+	}
+	if (buf[0] != 'p') {
+		fail("file lost the parent's write", 0);
+	}
+	for (i=0; i<NumPages; i++) {
+		if (buf[i*PageSize + 1] != 'c') {
+			fail("file lost the child's write", i);
+		}
+	}
+
+	munmap((void *)map, MapSize);
+	close(fd);
+	remove(FILENAME);
+	success(TEST161_SUCCESS, SECRET, "/testbin/mmapfork");
+	return 0;
+}
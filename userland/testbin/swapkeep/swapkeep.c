@@ -0,0 +1,109 @@
+/*
+ * swapkeep.c
+ *
+ *	Tests that pages read back from swap keep their contents when they
+ *	are evicted again while swap is nearly full. Past three quarters
+ *	full the VM system frees a page's slot as it reads the page back,
+ *	so the next eviction has to write the page out again.
+ *
+ *	The working set, in pages, is the first argument. It should be
+ *	larger than memory plus three quarters of the swap disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+#include <test161/test161.h>
+#include <test/test.h>
+
+#define PageSize	4096
+#define PageWords	(PageSize / sizeof(unsigned))
+#define DefaultPages	4096
+
+#define PROGRESS_INTERVAL 64
+
+/* Incompressible contents, different for every page and pass */
+static
+unsigned
+pattern(unsigned page, unsigned word, unsigned pass)
+{
+	unsigned x = page * 2654435761U + word * 40503U + pass * 977U;
+
+	x ^= x >> 15;
+	x *= 2246822519U;
+	x ^= x >> 13;
+	return x;
+}
+
+static
+void
+fill(unsigned *mem, unsigned npages, unsigned pass)
+{
+	unsigned i, j;
+
+	for (i=0; i<npages; i++) {
+		TEST161_LPROGRESS_N(i, PROGRESS_INTERVAL);
+		for (j=0; j<PageWords; j++) {
+			mem[i*PageWords + j] = pattern(i, j, pass);
+		}
+	}
+}
+
+static
+void
+check(unsigned *mem, unsigned npages, unsigned pass)
+{
+	unsigned i, j;
+
+	for (i=0; i<npages; i++) {
+		TEST161_LPROGRESS_N(i, PROGRESS_INTERVAL);
+		for (j=0; j<PageWords; j++) {
+			if (mem[i*PageWords + j] != pattern(i, j, pass)) {
+				lsay("\npage %u word %u lost its contents\n", i, j);
+				success(TEST161_FAIL, SECRET, "/testbin/swapkeep");
+				exit(1);
+			}
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned npages = DefaultPages;
+	unsigned *mem;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	mem = malloc(npages * PageSize);
+	if (mem == NULL) {
+		err(1, "malloc");
+	}
+
+	tprintf("swapkeep: %u pages\n", npages);
+
+	/* dirty everything, pushing most of it out to swap */
+	fill(mem, npages, 0);
+	lsay("\nstage [1] done\n");
+
+	/*
+	 * Read it all back. The pages come in from swap without being
+	 * written, and are evicted again by the pages read after them.
+	 */
+	check(mem, npages, 0);
+	lsay("\nstage [2] done\n");
+
+	/* and again, after those evictions */
+	check(mem, npages, 0);
+	lsay("\nstage [3] done\n");
+
+	/* the same with new contents, so stale slots would show */
+	fill(mem, npages, 1);
+	check(mem, npages, 1);
+	check(mem, npages, 1);
+	lsay("\nstage [4] done\n");
+
+	success(TEST161_SUCCESS, SECRET, "/testbin/swapkeep");
+	return 0;
+}